@@ -4,6 +4,10 @@
 #include <vector>
 #include <stdio.h>
 #include <stdlib.h>
+#include <float.h>
+#include <map>
+#include <set>
+#include <chrono>
 
 // Include GLEW
 #include <GL/glew.h>
@@ -27,18 +31,743 @@ using namespace glm;
 
 // Function prototypes
 void initialize();
+void initializeWindow();
+void initializeOffscreen();
 void createContext();
 void mainLoop();
+void renderFrame(const mat4& viewMatrix, const mat4& projectionMatrix);
+void renderOffscreen();
 void free();
-struct Light; struct Material;
+struct Light; struct Material; struct RigidTransform;
 void uploadMaterial(const Material& mtl);
 void uploadLight(const Light& light);
-map<int, mat4> calculateModelPoseFromCoordinates(map<int, float> q);
-vector<mat4> calculateSkinningTransformations(map<int, float> q);
-vector<float> calculateSkinningIndices();
+map<int, RigidTransform> calculateModelPoseFromCoordinates(map<int, float> q);
+struct BonePalette;
+void updateSkinningTransformations(map<int, float> q, BonePalette& palette);
+void updateBonePalette(BonePalette& palette);
+vector<float> calculateSkinningIndices(const vector<vec3>& vertices);
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //Header code dump
+//rigidtransform.h
+#ifndef RIGIDTRANSFORM_H
+#define RIGIDTRANSFORM_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+/* 3x4 row major affine matrix, the layout of the bone palette on the GPU
+* (a mat3x4 whose columns are these rows).
+*/
+struct BoneMatrix {
+	glm::vec4 rows[3];
+};
+
+/* A rotation followed by a translation. Joints only ever rotate and
+* translate, so this replaces the general 4x4 matrices on the kinematics
+* path: composition and inverse are closed form and it is 28 bytes instead
+* of 64.
+*/
+struct RigidTransform {
+	glm::quat rotation;
+	glm::vec3 translation;
+
+	RigidTransform() : translation(0.0f) {}
+	RigidTransform(const glm::quat& rotation, const glm::vec3& translation) :
+		rotation(rotation), translation(translation) {}
+
+	/* (a * b) applies b first, like the matrix product */
+	RigidTransform operator*(const RigidTransform& b) const {
+		return RigidTransform(rotation * b.rotation, rotation * b.translation + translation);
+	}
+
+	glm::vec3 transformPoint(const glm::vec3& p) const {
+		return rotation * p + translation;
+	}
+
+	glm::vec3 transformVector(const glm::vec3& v) const {
+		return rotation * v;
+	}
+
+	RigidTransform inverse() const {
+		glm::quat inv = glm::conjugate(rotation);
+		return RigidTransform(inv, -(inv * translation));
+	}
+
+	glm::mat4 toMat4() const {
+		glm::mat4 m = glm::mat4_cast(rotation);
+		m[3] = glm::vec4(translation, 1.0f);
+		return m;
+	}
+
+	BoneMatrix toBoneMatrix() const {
+		glm::mat3 r = glm::mat3_cast(rotation);
+		BoneMatrix b;
+		for (int i = 0; i < 3; i++) {
+			b.rows[i] = glm::vec4(r[0][i], r[1][i], r[2][i], translation[i]);
+		}
+		return b;
+	}
+};
+
+#endif
+//end of rigidtransform.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//arena.h
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+/* Bump allocator owning everything that belongs to one tree. Objects are
+* carved out of one block (further blocks are chained only if it runs out)
+* and released all at once when the arena is destroyed or reset. Types with
+* a non trivial destructor (e.g. Drawables holding GL buffers) are recorded
+* so their destructors still run, in reverse creation order.
+*/
+class TreeArena {
+public:
+	explicit TreeArena(size_t blockSize = 16 * 1024);
+	~TreeArena();
+
+	template<class T, class... Args>
+	T* create(Args&&... args) {
+		void* memory = allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value) {
+			Destructor* d = (Destructor*)allocate(sizeof(Destructor), alignof(Destructor));
+			d->destroy = &destroyObject<T>;
+			d->object = object;
+			d->next = destructors;
+			destructors = d;
+		}
+		return object;
+	}
+
+	/* Raw memory, used by ArenaAllocator */
+	void* allocate(size_t size, size_t alignment);
+
+	/* Run the recorded destructors and rewind to an empty first block */
+	void reset();
+
+	size_t bytesUsed() const;
+
+private:
+	struct Block {
+		Block* next;
+		size_t size, used;
+	};
+	struct Destructor {
+		void(*destroy)(void*);
+		void* object;
+		Destructor* next;
+	};
+
+	template<class T>
+	static void destroyObject(void* object) { static_cast<T*>(object)->~T(); }
+
+	TreeArena(const TreeArena&);
+	TreeArena& operator=(const TreeArena&);
+
+	Block* blocks;
+	Destructor* destructors;
+	size_t blockSize;
+};
+
+/* Standard allocator drawing from a TreeArena. Deallocation is a no-op, the
+* memory comes back when the arena is released.
+*/
+template<class T>
+struct ArenaAllocator {
+	typedef T value_type;
+	TreeArena* arena;
+
+	explicit ArenaAllocator(TreeArena* arena) : arena(arena) {}
+	template<class U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T*, size_t) {}
+
+	template<class U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template<class U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+#endif
+//end of arena.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//arena.cpp
+#include <stdlib.h>
+#include <stdexcept>
+
+TreeArena::TreeArena(size_t blockSize) : blocks(NULL), destructors(NULL), blockSize(blockSize) {
+}
+
+TreeArena::~TreeArena() {
+	reset();
+	::free(blocks);
+}
+
+void* TreeArena::allocate(size_t size, size_t alignment) {
+	if (blocks != NULL) {
+		size_t offset = (sizeof(Block) + blocks->used + alignment - 1) & ~(alignment - 1);
+		if (offset + size <= sizeof(Block) + blocks->size) {
+			blocks->used = offset + size - sizeof(Block);
+			return (char*)blocks + offset;
+		}
+	}
+
+	// chain a new block, big enough for oversized requests
+	size_t capacity = size + alignment > blockSize ? size + alignment : blockSize;
+	Block* block = (Block*)malloc(sizeof(Block) + capacity);
+	if (block == NULL) {
+		throw std::bad_alloc();
+	}
+	block->next = blocks;
+	block->size = capacity;
+	block->used = 0;
+	blocks = block;
+	return allocate(size, alignment);
+}
+
+void TreeArena::reset() {
+	while (destructors != NULL) {
+		Destructor* d = destructors;
+		destructors = d->next;
+		d->destroy(d->object);
+	}
+	// keep only the first block (the last in the chain) for reuse
+	while (blocks != NULL && blocks->next != NULL) {
+		Block* next = blocks->next;
+		::free(blocks);
+		blocks = next;
+	}
+	if (blocks != NULL) {
+		blocks->used = 0;
+	}
+}
+
+size_t TreeArena::bytesUsed() const {
+	size_t used = 0;
+	for (Block* b = blocks; b != NULL; b = b->next) {
+		used += b->used;
+	}
+	return used;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//mappedfile.h
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+#include <string>
+
+/* Read only memory mapping of a whole file. The pages are brought in by the
+* OS on first touch, so opening a large file costs nothing up front.
+*/
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	/* Map the file, throws if it cannot be opened or mapped */
+	void open(const std::string& path);
+	void close();
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+	/* Drop the pages of a range from memory, they are read from the file
+	* again if touched later
+	*/
+	void release(size_t offset, size_t size) const;
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* bytes;
+	size_t length;
+};
+
+#endif
+//end of mappedfile.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//mappedfile.cpp
+#include <stdexcept>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : bytes(NULL), length(0) {
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+void MappedFile::open(const std::string& path) {
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Failed to open " + path + "\n");
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	length = (size_t)fileSize.QuadPart;
+	if (length > 0) {
+		// the view keeps the mapping alive, the handles can go
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping != NULL) {
+			bytes = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open " + path + "\n");
+	}
+	struct stat status;
+	if (fstat(fd, &status) == 0) {
+		length = (size_t)status.st_size;
+	}
+	if (length > 0) {
+		void* view = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		bytes = view == MAP_FAILED ? NULL : (const unsigned char*)view;
+	}
+	::close(fd);
+#endif
+	if (length > 0 && bytes == NULL) {
+		length = 0;
+		throw std::runtime_error("Failed to map " + path + "\n");
+	}
+}
+
+void MappedFile::close() {
+	if (bytes != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(bytes);
+#else
+		munmap((void*)bytes, length);
+#endif
+	}
+	bytes = NULL;
+	length = 0;
+}
+
+void MappedFile::release(size_t offset, size_t size) const {
+	if (bytes == NULL || offset >= length) return;
+	// from the page holding offset, a page shared with a neighbouring range is
+	// simply read again
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page = info.dwPageSize;
+#else
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	size_t begin = offset / page * page;
+	size_t end = size > length - offset ? length : offset + size;
+	if (begin >= end) return;
+#ifdef _WIN32
+	// unlocking pages that were never locked takes them out of the working set
+	VirtualUnlock((LPVOID)(bytes + begin), end - begin);
+#else
+	madvise((void*)(bytes + begin), end - begin, MADV_DONTNEED);
+#endif
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//posetrack.h
+#ifndef POSETRACK_H
+#define POSETRACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define POSE_TRACK_VERSION 1
+
+/* Layout of a pose track file (little endian):
+*   PoseTrackHeader
+*   frames: a keyframe every keyframeInterval frames, delta frames between
+*   index: a uint64 byte offset per keyframe, at header.indexOffset
+* Every frame holds the local transformation of every joint of every tree.
+* Rotations are quantized to 16 bits per quaternion component, translations
+* to multiples of translationStep. Keyframes store these values raw, delta
+* frames store the difference from the previous frame as zigzag varints, so
+* a joint at rest costs 7 bytes per frame.
+*/
+struct PoseTrackHeader {
+	char magic[4];  // "PTRK"
+	uint32_t version;
+	uint32_t treeCount, jointCount, frameCount;
+	uint32_t keyframeInterval;
+	float translationStep;
+	uint32_t reserved;
+	uint64_t indexOffset;
+};
+
+// quantized joint local transformation, the unit of delta coding
+struct QuantizedJoint {
+	int32_t rotation[4];  // x, y, z, w in 1/32767
+	int32_t translation[3];  // in translationStep units
+};
+
+/* Records the poses handed to Skeleton::setPose. Joints not set in a frame
+* keep their previous transformation, so the incremental poses the
+* simulation produces can be captured as they are.
+*/
+class PoseTrackWriter {
+public:
+	PoseTrackWriter(const std::string& path, unsigned int treeCount,
+		unsigned int jointCount, unsigned int keyframeInterval = 32,
+		float translationStep = 1.0f / 4096.0f);
+	/* Finishes the file */
+	~PoseTrackWriter();
+
+	/* Update the pose of a tree in the frame being recorded */
+	void capture(unsigned int tree, const std::map<int, RigidTransform>& jointTransformations);
+
+	/* Encode the current poses of all trees as the next frame */
+	void endFrame();
+
+	/* Write the keyframe index and patch the header */
+	void close();
+
+	unsigned int frameCount() const { return header.frameCount; }
+
+private:
+	PoseTrackWriter(const PoseTrackWriter&);
+	PoseTrackWriter& operator=(const PoseTrackWriter&);
+
+	FILE* file;
+	PoseTrackHeader header;
+	std::vector<QuantizedJoint> current, previous;
+	std::vector<uint64_t> keyframeOffsets;
+	std::vector<unsigned char> frameBuffer;
+	uint64_t offset;
+};
+
+/* Plays a pose track back from a memory mapping. Sequential frames decode a
+* single delta, seeking elsewhere restarts from the closest keyframe before
+* the target.
+*/
+class PoseTrackReader {
+public:
+	PoseTrackReader();
+
+	/* Map and validate a track, throws on a malformed file */
+	void open(const std::string& path);
+
+	unsigned int treeCount() const { return header.treeCount; }
+	unsigned int jointCount() const { return header.jointCount; }
+	unsigned int frameCount() const { return header.frameCount; }
+
+	/* Decode the given frame */
+	void seek(unsigned int frame);
+
+	/* Local transformations of the tree's joints that changed with the last
+	* seek (all of them after a jump), ready for Skeleton::setPose
+	*/
+	void pose(unsigned int tree, std::map<int, RigidTransform>& jointTransformations) const;
+
+private:
+	void decodeFrame(bool keyframe);
+
+	MappedFile file;
+	PoseTrackHeader header;
+	const uint64_t* keyframeOffsets;
+	const unsigned char *cursor, *end;
+	int currentFrame;
+	std::vector<uint64_t> alignedIndex;
+	std::vector<QuantizedJoint> state;
+	std::vector<unsigned char> changed;
+};
+
+#endif
+//end of posetrack.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//posetrack.cpp
+#include <string.h>
+#include <math.h>
+#include <stdexcept>
+
+static const char poseTrackMagic[4] = { 'P', 'T', 'R', 'K' };
+
+static int32_t quantize(float value, float step) {
+	return (int32_t)floorf(value / step + 0.5f);
+}
+
+static QuantizedJoint quantizeJoint(const RigidTransform& transform,
+	const QuantizedJoint& previous, float translationStep) {
+	// q and -q are the same rotation, keep the sign closest to the previous
+	// frame so the deltas stay small
+	glm::quat r = transform.rotation;
+	float d = r.x * previous.rotation[0] + r.y * previous.rotation[1] +
+		r.z * previous.rotation[2] + r.w * previous.rotation[3];
+	if (d < 0) r = -r;
+
+	QuantizedJoint joint;
+	joint.rotation[0] = quantize(r.x, 1.0f / 32767.0f);
+	joint.rotation[1] = quantize(r.y, 1.0f / 32767.0f);
+	joint.rotation[2] = quantize(r.z, 1.0f / 32767.0f);
+	joint.rotation[3] = quantize(r.w, 1.0f / 32767.0f);
+	for (int i = 0; i < 3; i++) {
+		joint.translation[i] = quantize(transform.translation[i], translationStep);
+	}
+	return joint;
+}
+
+static RigidTransform dequantizeJoint(const QuantizedJoint& joint, float translationStep) {
+	glm::quat r(joint.rotation[3] / 32767.0f, joint.rotation[0] / 32767.0f,
+		joint.rotation[1] / 32767.0f, joint.rotation[2] / 32767.0f);
+	return RigidTransform(glm::normalize(r), glm::vec3(
+		joint.translation[0] * translationStep,
+		joint.translation[1] * translationStep,
+		joint.translation[2] * translationStep));
+}
+
+static void writeVarint(std::vector<unsigned char>& out, int32_t value) {
+	// zigzag, small magnitudes of either sign take one byte
+	uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+	while (v >= 0x80) {
+		out.push_back((unsigned char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char)v);
+}
+
+static int32_t readVarint(const unsigned char*& cursor, const unsigned char* end) {
+	uint32_t v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (cursor >= end) {
+			throw std::runtime_error("Truncated pose track\n");
+		}
+		unsigned char byte = *cursor++;
+		v |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+		}
+	}
+	throw std::runtime_error("Malformed pose track\n");
+}
+
+PoseTrackWriter::PoseTrackWriter(const std::string& path, unsigned int treeCount,
+	unsigned int jointCount, unsigned int keyframeInterval, float translationStep) :
+	current(treeCount * jointCount), previous(treeCount * jointCount), offset(0) {
+	file = fopen(path.c_str(), "wb");
+	if (file == NULL) {
+		throw std::runtime_error("Failed to create " + path + "\n");
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, poseTrackMagic, 4);
+	header.version = POSE_TRACK_VERSION;
+	header.treeCount = treeCount;
+	header.jointCount = jointCount;
+	header.keyframeInterval = keyframeInterval > 0 ? keyframeInterval : 1;
+	header.translationStep = translationStep;
+
+	// identity until the first capture
+	QuantizedJoint identity = quantizeJoint(RigidTransform(), QuantizedJoint(), translationStep);
+	current.assign(current.size(), identity);
+	previous = current;
+
+	// patched by close
+	fwrite(&header, sizeof(header), 1, file);
+	offset = sizeof(header);
+}
+
+PoseTrackWriter::~PoseTrackWriter() {
+	close();
+}
+
+void PoseTrackWriter::capture(unsigned int tree,
+	const std::map<int, RigidTransform>& jointTransformations) {
+	QuantizedJoint* joints = &current[tree * header.jointCount];
+	for (const auto& tran : jointTransformations) {
+		if (tran.first < 0 || tran.first >= (int)header.jointCount) continue;
+		joints[tran.first] = quantizeJoint(tran.second,
+			previous[tree * header.jointCount + tran.first], header.translationStep);
+	}
+}
+
+void PoseTrackWriter::endFrame() {
+	if (file == NULL) return;
+
+	bool keyframe = header.frameCount % header.keyframeInterval == 0;
+	frameBuffer.clear();
+	if (keyframe) {
+		keyframeOffsets.push_back(offset);
+		const unsigned char* raw = (const unsigned char*)current.data();
+		frameBuffer.assign(raw, raw + current.size() * sizeof(QuantizedJoint));
+	}
+	else {
+		for (size_t i = 0; i < current.size(); i++) {
+			for (int c = 0; c < 4; c++) {
+				writeVarint(frameBuffer, current[i].rotation[c] - previous[i].rotation[c]);
+			}
+			for (int c = 0; c < 3; c++) {
+				writeVarint(frameBuffer, current[i].translation[c] - previous[i].translation[c]);
+			}
+		}
+	}
+	fwrite(frameBuffer.data(), 1, frameBuffer.size(), file);
+	offset += frameBuffer.size();
+	previous = current;
+	header.frameCount++;
+}
+
+void PoseTrackWriter::close() {
+	if (file == NULL) return;
+
+	header.indexOffset = offset;
+	if (!keyframeOffsets.empty()) {
+		fwrite(keyframeOffsets.data(), sizeof(uint64_t), keyframeOffsets.size(), file);
+	}
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+	file = NULL;
+}
+
+PoseTrackReader::PoseTrackReader() : keyframeOffsets(NULL), cursor(NULL), end(NULL),
+	currentFrame(-1) {
+	memset(&header, 0, sizeof(header));
+}
+
+void PoseTrackReader::open(const std::string& path) {
+	file.open(path);
+	if (file.size() < sizeof(PoseTrackHeader)) {
+		throw std::runtime_error("Invalid pose track " + path + "\n");
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, poseTrackMagic, 4) != 0 ||
+		header.version != POSE_TRACK_VERSION || header.keyframeInterval == 0) {
+		throw std::runtime_error("Invalid pose track " + path + "\n");
+	}
+
+	uint64_t keyframes = ((uint64_t)header.frameCount + header.keyframeInterval - 1) /
+		header.keyframeInterval;
+	if (header.indexOffset < sizeof(PoseTrackHeader) || header.indexOffset > file.size() ||
+		keyframes > (file.size() - header.indexOffset) / sizeof(uint64_t)) {
+		throw std::runtime_error("Truncated pose track " + path + "\n");
+	}
+	// the header is 40 bytes and frames are byte granular, copy the index
+	// only if the mapping leaves it misaligned
+	keyframeOffsets = (const uint64_t*)(file.data() + header.indexOffset);
+	if ((uintptr_t)keyframeOffsets % alignof(uint64_t) != 0) {
+		alignedIndex.resize((size_t)keyframes);
+		memcpy(alignedIndex.data(), keyframeOffsets, (size_t)keyframes * sizeof(uint64_t));
+		keyframeOffsets = alignedIndex.data();
+	}
+	// every keyframe lies between the header and the index
+	for (uint64_t k = 0; k < keyframes; k++) {
+		if (keyframeOffsets[k] < sizeof(PoseTrackHeader) || keyframeOffsets[k] >= header.indexOffset) {
+			throw std::runtime_error("Invalid pose track " + path + "\n");
+		}
+	}
+	end = file.data() + header.indexOffset;
+
+	state.resize(header.treeCount * header.jointCount);
+	changed.assign(state.size(), 1);
+	currentFrame = -1;
+}
+
+void PoseTrackReader::seek(unsigned int frame) {
+	if (frame >= header.frameCount) {
+		throw std::runtime_error("Pose track frame out of range\n");
+	}
+	if ((int)frame == currentFrame) {
+		changed.assign(changed.size(), 0);
+		return;
+	}
+	changed.assign(changed.size(), 0);
+	unsigned int keyframe = frame / header.keyframeInterval * header.keyframeInterval;
+	if (currentFrame < (int)keyframe || currentFrame > (int)frame) {
+		// restart from the keyframe, after a jump every joint counts as changed
+		bool jump = currentFrame + 1 != (int)keyframe;
+		cursor = file.data() + keyframeOffsets[frame / header.keyframeInterval];
+		decodeFrame(true);
+		if (jump) changed.assign(changed.size(), 1);
+		currentFrame = keyframe;
+	}
+	while (currentFrame < (int)frame) {
+		decodeFrame(false);
+		currentFrame++;
+	}
+}
+
+void PoseTrackReader::decodeFrame(bool keyframe) {
+	if (keyframe) {
+		size_t bytes = state.size() * sizeof(QuantizedJoint);
+		if (cursor < file.data() || cursor > end || (size_t)(end - cursor) < bytes) {
+			throw std::runtime_error("Truncated pose track\n");
+		}
+		for (size_t i = 0; i < state.size(); i++, cursor += sizeof(QuantizedJoint)) {
+			if (memcmp(&state[i], cursor, sizeof(QuantizedJoint)) != 0) {
+				memcpy(&state[i], cursor, sizeof(QuantizedJoint));
+				changed[i] = 1;
+			}
+		}
+		return;
+	}
+	for (size_t i = 0; i < state.size(); i++) {
+		int32_t delta = 0, d;
+		for (int c = 0; c < 4; c++) {
+			d = readVarint(cursor, end);
+			state[i].rotation[c] += d;
+			delta |= d;
+		}
+		for (int c = 0; c < 3; c++) {
+			d = readVarint(cursor, end);
+			state[i].translation[c] += d;
+			delta |= d;
+		}
+		if (delta != 0) changed[i] = 1;
+	}
+}
+
+void PoseTrackReader::pose(unsigned int tree,
+	std::map<int, RigidTransform>& jointTransformations) const {
+	jointTransformations.clear();
+	if (tree >= header.treeCount) return;
+	for (unsigned int j = 0; j < header.jointCount; j++) {
+		size_t i = tree * header.jointCount + j;
+		if (changed[i]) {
+			jointTransformations[j] = dequantizeJoint(state[i], header.translationStep);
+		}
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 //skeleton.h
 #ifndef SKELETON_H
 #define SKELETON_H
@@ -52,8 +781,13 @@ class Drawable;
 
 struct Joint {
 	Joint* parent = NULL;
-	glm::mat4 jointLocalTransformation, jointWorldTransformation,
-		jointBindTransformation;
+	RigidTransform jointLocalTransformation, jointWorldTransformation,
+		jointBindTransformation;  // world transformation at the binding pose
+
+	// set by setPose, cleared once the world transformation is recomputed
+	bool dirty = true;
+	// whether the last updateWorldTransformations changed this joint
+	bool worldChanged = false;
 
 	/** After updating the jointLocalTransformation call this method to compute
 	* the jointWorldTransformation
@@ -63,10 +797,10 @@ struct Joint {
 
 struct Body {
 	Joint* joint;  // not owned by the body, just a reference pointer
-	std::vector<Drawable*> drawables; // owned by the body, thus must be freed
+	// allocated in the skeleton's arena, freed together with it
+	std::vector<Drawable*, ArenaAllocator<Drawable*> > drawables;
 
-									  /* Free all drawables (a body can have many drawables)*/
-	~Body();
+	explicit Body(TreeArena& arena) : drawables(ArenaAllocator<Drawable*>(&arena)) {}
 
 	/* Given the view and projection matrix draw every attached drawables */
 	void draw(
@@ -76,9 +810,15 @@ struct Body {
 		const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix);
 };
 
+template<class V>
+using ArenaMap = std::map<int, V, std::less<int>, ArenaAllocator<std::pair<const int, V> > >;
+
 struct Skeleton {
-	std::map<int, Body*> bodies;
-	std::map<int, Joint*> joints;
+	// owns the joints, bodies and drawables of the tree, declared first so
+	// it outlives the containers below
+	TreeArena arena;
+	ArenaMap<Body*> bodies;
+	ArenaMap<Joint*> joints;
 
 	// shader locations to M, V, P
 	GLuint modelMatrixLocation, viewMatrixLocation, projectionMatrixLocation;
@@ -88,17 +828,34 @@ struct Skeleton {
 		GLuint viewMatrixLocation,
 		GLuint projectionMatrixLocation);
 
-	/* Free all bodies and joints*/
+	/* Free all bodies, joints and drawables at once (through the arena) */
 	~Skeleton();
 
 	/* Update joint local coordinates */
-	void setPose(const std::map<int, glm::mat4>& jointTransformations);
+	void setPose(const std::map<int, RigidTransform>& jointTransformations);
+
+	/* Set the pose the mesh is bound to and remember the joint world
+	* transformations at that pose
+	*/
+	void setBindingPose(const std::map<int, RigidTransform>& jointTransformations);
 
 	/* Given the view and projection matrix draw every attached drawables */
 	void draw(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix);
 
 	/* Get joint world transformations after setting the pose */
-	std::map<int, glm::mat4> getJointWorldTransformations();
+	std::map<int, RigidTransform> getJointWorldTransformations();
+
+	/* Recompute the world transformations of the joints changed by setPose
+	* and of their descendants only. Returns the joints that were updated.
+	*/
+	const std::vector<int>& updateWorldTransformations();
+
+	// joints updated by the last updateWorldTransformations
+	std::vector<int> changedJoints;
+
+	// when set, every pose is also captured as this tree of the track
+	PoseTrackWriter* recorder = NULL;
+	unsigned int recorderSlot = 0;
 };
 
 #endif
@@ -119,20 +876,14 @@ void Joint::updateWorldTransformation() {
 	}
 }
 
-Body::~Body() {
-	for (Drawable* d : drawables) {
-		delete d;
-	}
-}
-
 void Body::draw(
 	const GLuint& modelMatrixLocation,
 	const GLuint& viewMatrixLocation,
 	const GLuint& projectionMatrixLocation,
 	const glm::mat4 & viewMatrix, const glm::mat4 & projectionMatrix) {
 	joint->updateWorldTransformation();
-	glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE,
-		&joint->jointWorldTransformation[0][0]);
+	glm::mat4 modelMatrix = joint->jointWorldTransformation.toMat4();
+	glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &modelMatrix[0][0]);
 	glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
 	glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE,
 		&projectionMatrix[0][0]);
@@ -147,24 +898,35 @@ Skeleton::Skeleton(
 	GLuint modelMatrixLocation,
 	GLuint viewMatrixLocation,
 	GLuint projectionMatrixLocation) :
+	bodies(std::less<int>(), ArenaAllocator<std::pair<const int, Body*> >(&arena)),
+	joints(std::less<int>(), ArenaAllocator<std::pair<const int, Joint*> >(&arena)),
 	modelMatrixLocation(modelMatrixLocation),
 	viewMatrixLocation(viewMatrixLocation),
 	projectionMatrixLocation(projectionMatrixLocation) {
 }
 
 Skeleton::~Skeleton() {
-	for (auto body : bodies) {
-		delete body.second;
-	}
-
-	for (auto joint : joints) {
-		delete joint.second;
-	}
+	// the maps release nothing, the arena runs the destructors and frees its
+	// block after them
+	bodies.clear();
+	joints.clear();
 }
 
-void Skeleton::setPose(const std::map<int, glm::mat4>& jointTransformations) {
+void Skeleton::setPose(const std::map<int, RigidTransform>& jointTransformations) {
 	for (const auto& tran : jointTransformations) {
 		joints[tran.first]->jointLocalTransformation = tran.second;
+		joints[tran.first]->dirty = true;
+	}
+	if (recorder != NULL) {
+		recorder->capture(recorderSlot, jointTransformations);
+	}
+}
+
+void Skeleton::setBindingPose(const std::map<int, RigidTransform>& jointTransformations) {
+	setPose(jointTransformations);
+	for (auto joint : joints) {
+		joint.second->updateWorldTransformation();
+		joint.second->jointBindTransformation = joint.second->jointWorldTransformation;
 	}
 }
 
@@ -175,8 +937,8 @@ void Skeleton::draw(const glm::mat4 & viewMatrix, const glm::mat4 & projectionMa
 	}
 }
 
-std::map<int, glm::mat4> Skeleton::getJointWorldTransformations() {
-	std::map<int, glm::mat4> jointWorldTransformations;
+std::map<int, RigidTransform> Skeleton::getJointWorldTransformations() {
+	std::map<int, RigidTransform> jointWorldTransformations;
 	// update before computing
 	for (auto joint : joints) {
 		joint.second->updateWorldTransformation();
@@ -188,44 +950,3818 @@ std::map<int, glm::mat4> Skeleton::getJointWorldTransformations() {
 
 	return  jointWorldTransformations;
 }
+
+const std::vector<int>& Skeleton::updateWorldTransformations() {
+	// joint ids are assigned parents first, so one ordered pass propagates
+	changedJoints.clear();
+	for (auto joint : joints) {
+		Joint* j = joint.second;
+		j->worldChanged = j->dirty || (j->parent != NULL && j->parent->worldChanged);
+		if (j->worldChanged) {
+			j->updateWorldTransformation();
+			j->dirty = false;
+			changedJoints.push_back(joint.first);
+		}
+	}
+	return changedJoints;
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/////////////////////////////////////////////////////////////////////////////////////////
+//lod.h
+#ifndef LOD_H
+#define LOD_H
 
+#include <GL/glew.h>
+#include <vector>
+#include <map>
+#include <glm/glm.hpp>
 
-#define W_WIDTH 1024
-#define W_HEIGHT 768
-#define TITLE "Lab 05"
+#define LOD_LEVELS 4
+
+/* A simplified mesh owned by a LOD level. Unlike Drawable it also carries the
+* per-vertex bone index (attribute 3) so it can be skinned like the full trunk.
+*/
+struct LODMesh {
+	GLuint VAO, verticesVBO, normalsVBO, uvsVBO, boneIndicesVBO, elementVBO;
+	GLsizei indexCount;
+
+	LODMesh(
+		const std::vector<glm::vec3>& vertices,
+		const std::vector<glm::vec3>& normals,
+		const std::vector<glm::vec2>& uvs,
+		const std::vector<float>& boneIndices,
+		const std::vector<unsigned int>& indices);
+	~LODMesh();
+
+	void bind();
+	void draw(GLenum mode = GL_TRIANGLES);
+};
 
-void defineJointPoints();
-void quickSort(std::vector<float> &arr, std::vector<int> &indices, int left, int right);
-struct Light; struct Material;
-void uploadMaterial(const Material& mtl);
-void uploadLight(const Light& light);
+/* Precomputed data for one level of detail. Level 0 is the full resolution
+* tree and has no meshes of its own, the last level is a baked impostor.
+*/
+struct LODLevel {
+	LODMesh* trunk = NULL;
+	LODMesh* leaves = NULL;  // leaf cards or impostor quads
+	std::vector<int> jointRemap;  // joint -> joint actually used for skinning
+	float minScreenSize;  // projected radius (fraction of the viewport half height)
+};
 
+/* Per tree instance LOD state */
+struct TreeInstance {
+	glm::mat4 modelMatrix;
+	glm::vec3 boundsCenter;  // model space bounding sphere
+	float boundsRadius;
+	int lodLevel = 0;
+
+	// culling results, refreshed every frame; shadow casters are the trees in
+	// the light frustum, seen by the camera or not
+	bool visible = true;
+	bool shadowCaster = true;
+	std::vector<unsigned char> leafClusterVisible;
+
+	// back to front leaf triangle order, kept from frame to frame, and the
+	// index buffer contents of the visible leaves in that order
+	std::vector<unsigned int> leafOrder;
+	std::vector<unsigned int> leafIndices;
+};
 
-// Global variables
-GLFWwindow* window;
-Camera* camera;
-GLuint shaderProgram;
-GLuint projectionMatrixLocation, viewMatrixLocation, modelMatrixLocation, modelMatrixLocation2, planeLocation;
-GLuint diffuceColorSampler, specularColorSampler;
-GLuint diffuseTexturetree, specularTexturetree, diffuseTextureleaves, specularTextureleaves;
-GLuint treeVAO, leavesVAO, planeVAO;
-GLuint treeVerticiesVBO, treeUVVBO, treeNormalsVBO, leavesVerticiesVBO, leavesUVVBO, leavesNormalsVBO, planeColorsVAO, planeColorsVBO, planeVerticiesVBO;
-std::vector<vec3> objVerticestree, objNormalstree, objVerticesleaves, objNormalsleaves;
-std::vector<vec2> objUVstree, objUVsleaves;
-std::vector<vec3> treeJoints;
-Skeleton* skeleton;
-// light properties
-GLuint LaLocation, LdLocation, LsLocation, lightPositionLocation, lightPowerLocation;
-// material properties
-GLuint KdLocation, KsLocation, KaLocation, NsLocation;
-Drawable *segment, *skeletonSkin;
-GLuint useSkinningLocation, boneTransformationsLocation;
-GLuint surfaceVAO, surfaceVerticesVBO, surfacesBoneIndecesVBO, maleBoneIndicesVBO;
-float t = 0;
+/* Quadric error metric edge collapse. Vertices are only collapsed onto
+* vertices with the same bone index, so the skinning stays untouched. Returns
+* the simplified mesh through the output arguments.
+*/
+void decimateMesh(
+	const std::vector<glm::vec3>& vertices,
+	const std::vector<glm::vec3>& normals,
+	const std::vector<glm::vec2>& uvs,
+	const std::vector<float>& boneIndices,
+	const std::vector<unsigned int>& indices,
+	float targetRatio,
+	std::vector<glm::vec3>& outVertices,
+	std::vector<glm::vec3>& outNormals,
+	std::vector<glm::vec2>& outUVs,
+	std::vector<float>& outBoneIndices,
+	std::vector<unsigned int>& outIndices);
+
+/* Collapse short terminal (twig) bones into their parents until every
+* remaining leaf bone is at least minBoneLength long. The result maps every
+* joint to the joint that takes over its vertices.
+*/
+std::vector<int> collapseShortBones(
+	const std::map<int, RigidTransform>& bindLocalTransformations,
+	const std::map<int, int>& parents,
+	int jointCount, float minBoneLength);
+
+/* Replace the leaf triangles with two crossed cards per grid cell */
+void buildLeafCards(
+	const std::vector<glm::vec3>& leafVertices, float cellSize,
+	std::vector<glm::vec3>& outVertices,
+	std::vector<glm::vec3>& outNormals,
+	std::vector<glm::vec2>& outUVs);
+
+/* Pick the level for an instance from its projected size. A level is only
+* left when the size moves past the threshold by the hysteresis fraction,
+* so instances near a threshold do not flicker between levels.
+*/
+int selectLODLevel(
+	const TreeInstance& tree, const std::vector<LODLevel>& levels,
+	const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix,
+	float hysteresis);
 
-struct Light {
+#endif
+//end of lod.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//lod.cpp
+#include <queue>
+#include <set>
+#include <tuple>
+#include <cmath>
+#include <algorithm>
+
+LODMesh::LODMesh(
+	const std::vector<glm::vec3>& vertices,
+	const std::vector<glm::vec3>& normals,
+	const std::vector<glm::vec2>& uvs,
+	const std::vector<float>& boneIndices,
+	const std::vector<unsigned int>& indices) {
+	indexCount = (GLsizei)indices.size();
+
+	glGenVertexArrays(1, &VAO);
+	glBindVertexArray(VAO);
+
+	glGenBuffers(1, &verticesVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, verticesVBO);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3),
+		&vertices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(0);
+
+	glGenBuffers(1, &normalsVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, normalsVBO);
+	glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3),
+		&normals[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(1);
+
+	glGenBuffers(1, &uvsVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, uvsVBO);
+	glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2),
+		&uvs[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(2);
+
+	glGenBuffers(1, &boneIndicesVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, boneIndicesVBO);
+	glBufferData(GL_ARRAY_BUFFER, boneIndices.size() * sizeof(float),
+		&boneIndices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(3);
+
+	glGenBuffers(1, &elementVBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementVBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
+		&indices[0], GL_STATIC_DRAW);
+
+	glBindVertexArray(0);
+}
+
+LODMesh::~LODMesh() {
+	glDeleteBuffers(1, &verticesVBO);
+	glDeleteBuffers(1, &normalsVBO);
+	glDeleteBuffers(1, &uvsVBO);
+	glDeleteBuffers(1, &boneIndicesVBO);
+	glDeleteBuffers(1, &elementVBO);
+	glDeleteVertexArrays(1, &VAO);
+}
+
+void LODMesh::bind() {
+	glBindVertexArray(VAO);
+}
+
+void LODMesh::draw(GLenum mode) {
+	glDrawElements(mode, indexCount, GL_UNSIGNED_INT, NULL);
+}
+
+// symmetric 4x4 quadric stored as its upper triangle
+struct Quadric {
+	double a[10] = { 0 };
+
+	void addPlane(const glm::vec3& n, float d, double w) {
+		double p[4] = { n.x, n.y, n.z, d };
+		int k = 0;
+		for (int i = 0; i < 4; i++)
+			for (int j = i; j < 4; j++)
+				a[k++] += w * p[i] * p[j];
+	}
+
+	void add(const Quadric& q) {
+		for (int i = 0; i < 10; i++) a[i] += q.a[i];
+	}
+
+	double error(const glm::vec3& v) const {
+		double x = v.x, y = v.y, z = v.z;
+		return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+			+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z
+			+ a[9];
+	}
+};
+
+struct EdgeCollapse {
+	double cost;
+	unsigned int from, to;
+	unsigned int fromVersion, toVersion;
+
+	bool operator<(const EdgeCollapse& o) const { return cost > o.cost; }
+};
+
+void decimateMesh(
+	const std::vector<glm::vec3>& vertices,
+	const std::vector<glm::vec3>& normals,
+	const std::vector<glm::vec2>& uvs,
+	const std::vector<float>& boneIndices,
+	const std::vector<unsigned int>& indices,
+	float targetRatio,
+	std::vector<glm::vec3>& outVertices,
+	std::vector<glm::vec3>& outNormals,
+	std::vector<glm::vec2>& outUVs,
+	std::vector<float>& outBoneIndices,
+	std::vector<unsigned int>& outIndices) {
+	size_t vertexCount = vertices.size();
+	size_t faceCount = indices.size() / 3;
+	std::vector<unsigned int> tris(indices);
+	std::vector<bool> faceAlive(faceCount, true);
+	std::vector<std::vector<unsigned int>> vertexFaces(vertexCount);
+	std::vector<Quadric> quadrics(vertexCount);
+	std::vector<unsigned int> version(vertexCount, 0);
+	std::vector<bool> vertexAlive(vertexCount, true);
+
+	// face quadrics, area weighted
+	for (size_t f = 0; f < faceCount; f++) {
+		const glm::vec3& p0 = vertices[tris[3 * f]];
+		const glm::vec3& p1 = vertices[tris[3 * f + 1]];
+		const glm::vec3& p2 = vertices[tris[3 * f + 2]];
+		glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+		float area = glm::length(n);
+		if (area > 0) n = n / area;
+		for (int k = 0; k < 3; k++) {
+			quadrics[tris[3 * f + k]].addPlane(n, -glm::dot(n, p0), area);
+			vertexFaces[tris[3 * f + k]].push_back((unsigned int)f);
+		}
+	}
+
+	// boundary edges (mesh borders and UV seams) get a perpendicular plane so
+	// they are not eaten away
+	std::map<std::pair<unsigned int, unsigned int>, int> edgeUse;
+	for (size_t f = 0; f < faceCount; f++) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int a = tris[3 * f + k], b = tris[3 * f + (k + 1) % 3];
+			edgeUse[std::make_pair(std::min(a, b), std::max(a, b))]++;
+		}
+	}
+	for (size_t f = 0; f < faceCount; f++) {
+		const glm::vec3& p0 = vertices[tris[3 * f]];
+		glm::vec3 n = glm::cross(vertices[tris[3 * f + 1]] - p0, vertices[tris[3 * f + 2]] - p0);
+		for (int k = 0; k < 3; k++) {
+			unsigned int a = tris[3 * f + k], b = tris[3 * f + (k + 1) % 3];
+			if (edgeUse[std::make_pair(std::min(a, b), std::max(a, b))] != 1) continue;
+			glm::vec3 e = vertices[b] - vertices[a];
+			glm::vec3 m = glm::cross(e, n);
+			float len = glm::length(m);
+			if (len == 0) continue;
+			m = m / len;
+			double w = 10.0 * glm::dot(e, e);
+			quadrics[a].addPlane(m, -glm::dot(m, vertices[a]), w);
+			quadrics[b].addPlane(m, -glm::dot(m, vertices[a]), w);
+		}
+	}
+
+	// half edge collapses keep the surviving vertex attributes as they are
+	std::priority_queue<EdgeCollapse> heap;
+	auto pushEdge = [&](unsigned int a, unsigned int b) {
+		if (boneIndices[a] != boneIndices[b]) return;
+		Quadric q = quadrics[a];
+		q.add(quadrics[b]);
+		double ab = q.error(vertices[b]), ba = q.error(vertices[a]);
+		if (ab <= ba) heap.push(EdgeCollapse{ ab, a, b, version[a], version[b] });
+		else heap.push(EdgeCollapse{ ba, b, a, version[b], version[a] });
+	};
+	for (const auto& e : edgeUse) {
+		pushEdge(e.first.first, e.first.second);
+	}
+
+	size_t aliveFaces = faceCount;
+	size_t targetFaces = (size_t)(faceCount * targetRatio);
+	while (aliveFaces > targetFaces && !heap.empty()) {
+		EdgeCollapse c = heap.top();
+		heap.pop();
+		if (!vertexAlive[c.from] || !vertexAlive[c.to] ||
+			version[c.from] != c.fromVersion || version[c.to] != c.toVersion) {
+			continue;
+		}
+
+		// reject collapses that flip a face
+		bool flips = false;
+		for (unsigned int f : vertexFaces[c.from]) {
+			if (!faceAlive[f]) continue;
+			glm::vec3 p[3], q[3];
+			bool shared = false;
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = tris[3 * f + k];
+				if (v == c.to) shared = true;
+				p[k] = vertices[v];
+				q[k] = v == c.from ? vertices[c.to] : vertices[v];
+			}
+			if (shared) continue;
+			glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+			glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+			if (glm::dot(n0, n1) <= 0.2f * glm::length(n0) * glm::length(n1)) {
+				flips = true;
+				break;
+			}
+		}
+		if (flips) continue;
+
+		vertexAlive[c.from] = false;
+		quadrics[c.to].add(quadrics[c.from]);
+		version[c.to]++;
+		std::set<unsigned int> neighbours;
+		for (unsigned int f : vertexFaces[c.from]) {
+			if (!faceAlive[f]) continue;
+			bool degenerate = false;
+			for (int k = 0; k < 3; k++) {
+				if (tris[3 * f + k] == c.to) degenerate = true;
+			}
+			if (degenerate) {
+				faceAlive[f] = false;
+				aliveFaces--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++) {
+				if (tris[3 * f + k] == c.from) tris[3 * f + k] = c.to;
+				else neighbours.insert(tris[3 * f + k]);
+			}
+			vertexFaces[c.to].push_back(f);
+		}
+		for (unsigned int f : vertexFaces[c.to]) {
+			if (!faceAlive[f]) continue;
+			for (int k = 0; k < 3; k++) {
+				if (tris[3 * f + k] != c.to) neighbours.insert(tris[3 * f + k]);
+			}
+		}
+		for (unsigned int n : neighbours) {
+			pushEdge(c.to, n);
+		}
+	}
+
+	// compact
+	std::vector<int> remap(vertexCount, -1);
+	outVertices.clear(); outNormals.clear(); outUVs.clear();
+	outBoneIndices.clear(); outIndices.clear();
+	for (size_t f = 0; f < faceCount; f++) {
+		if (!faceAlive[f]) continue;
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = tris[3 * f + k];
+			if (remap[v] < 0) {
+				remap[v] = (int)outVertices.size();
+				outVertices.push_back(vertices[v]);
+				outNormals.push_back(normals[v]);
+				outUVs.push_back(uvs[v]);
+				outBoneIndices.push_back(boneIndices[v]);
+			}
+			outIndices.push_back(remap[v]);
+		}
+	}
+}
+
+std::vector<int> collapseShortBones(
+	const std::map<int, RigidTransform>& bindLocalTransformations,
+	const std::map<int, int>& parents,
+	int jointCount, float minBoneLength) {
+	std::vector<int> remap(jointCount);
+	for (int i = 0; i < jointCount; i++) remap[i] = i;
+
+	std::vector<int> children(jointCount, 0);
+	for (const auto& p : parents) {
+		if (p.second >= 0) children[p.second]++;
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const auto& p : parents) {
+			int joint = p.first, parent = p.second;
+			if (parent < 0 || remap[joint] != joint || children[joint] != 0) continue;
+			auto local = bindLocalTransformations.find(joint);
+			if (local == bindLocalTransformations.end()) continue;
+			float length = glm::length(local->second.translation);
+			if (length >= minBoneLength) continue;
+			remap[joint] = parent;
+			children[parent]--;
+			changed = true;
+		}
+	}
+
+	// resolve chains so every joint points to a surviving joint
+	for (int i = 0; i < jointCount; i++) {
+		int j = i;
+		while (remap[j] != j) j = remap[j];
+		remap[i] = j;
+	}
+	return remap;
+}
+
+void buildLeafCards(
+	const std::vector<glm::vec3>& leafVertices, float cellSize,
+	std::vector<glm::vec3>& outVertices,
+	std::vector<glm::vec3>& outNormals,
+	std::vector<glm::vec2>& outUVs) {
+	struct Cell { glm::vec3 min, max; };
+	std::map<std::tuple<int, int, int>, Cell> cells;
+	float leafSize = 0;
+	for (size_t i = 0; i + 2 < leafVertices.size(); i += 3) {
+		glm::vec3 c = (leafVertices[i] + leafVertices[i + 1] + leafVertices[i + 2]) / 3.0f;
+		leafSize += glm::length(leafVertices[i + 1] - leafVertices[i]);
+		auto key = std::make_tuple(
+			(int)floor(c.x / cellSize), (int)floor(c.y / cellSize), (int)floor(c.z / cellSize));
+		auto it = cells.find(key);
+		if (it == cells.end()) {
+			cells[key] = Cell{ c, c };
+			it = cells.find(key);
+		}
+		for (int k = 0; k < 3; k++) {
+			it->second.min = glm::min(it->second.min, leafVertices[i + k]);
+			it->second.max = glm::max(it->second.max, leafVertices[i + k]);
+		}
+	}
+	leafSize = leafVertices.size() >= 3 ? leafSize / (leafVertices.size() / 3) : 1.0f;
+
+	// two crossed quads per cell, the leaf texture repeats once per leaf size
+	for (const auto& cell : cells) {
+		glm::vec3 lo = cell.second.min, hi = cell.second.max;
+		glm::vec3 c = (lo + hi) * 0.5f;
+		glm::vec3 axes[2] = { glm::vec3(1, 0, 0), glm::vec3(0, 0, 1) };
+		for (int a = 0; a < 2; a++) {
+			glm::vec3 u = axes[a] * (glm::dot(hi - lo, axes[a]) * 0.5f);
+			glm::vec3 v = glm::vec3(0, (hi.y - lo.y) * 0.5f, 0);
+			glm::vec3 n = glm::cross(axes[a], glm::vec3(0, 1, 0));
+			glm::vec2 uvScale = glm::vec2(
+				std::max(glm::length(u) * 2.0f / leafSize, 1.0f),
+				std::max(glm::length(v) * 2.0f / leafSize, 1.0f));
+			glm::vec3 quad[6] = { c - u - v, c + u - v, c + u + v, c - u - v, c + u + v, c - u + v };
+			glm::vec2 quadUV[6] = {
+				glm::vec2(0, 0), glm::vec2(1, 0), glm::vec2(1, 1),
+				glm::vec2(0, 0), glm::vec2(1, 1), glm::vec2(0, 1) };
+			for (int k = 0; k < 6; k++) {
+				outVertices.push_back(quad[k]);
+				outNormals.push_back(n);
+				outUVs.push_back(quadUV[k] * uvScale);
+			}
+		}
+	}
+}
+
+int selectLODLevel(
+	const TreeInstance& tree, const std::vector<LODLevel>& levels,
+	const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix,
+	float hysteresis) {
+	glm::vec4 center = viewMatrix * tree.modelMatrix * glm::vec4(tree.boundsCenter, 1.0f);
+	float scale = glm::length(glm::vec3(tree.modelMatrix[0]));
+	float depth = std::max(-center.z, 0.001f);
+	// projected radius as a fraction of the viewport half height
+	float screenSize = tree.boundsRadius * scale * projectionMatrix[1][1] / depth;
+
+	int level = tree.lodLevel;
+	// refine while we are clearly above the current level's threshold
+	while (level > 0 && screenSize > levels[level - 1].minScreenSize * (1.0f + hysteresis)) {
+		level--;
+	}
+	// coarsen while we are clearly below it
+	while (level < (int)levels.size() - 1 &&
+		screenSize < levels[level].minScreenSize * (1.0f - hysteresis)) {
+		level++;
+	}
+	return level;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//culling.h
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <glm/glm.hpp>
+
+struct AABB {
+	glm::vec3 min, max;
+
+	void expand(const glm::vec3& p);
+	void expand(const AABB& box);
+};
+
+/* Bounding box of a box transformed by an affine matrix */
+AABB transformAABB(const AABB& box, const glm::mat4& transformation);
+
+/* Frustum planes (a, b, c, d) with the normals pointing inside */
+struct Frustum {
+	glm::vec4 planes[6];
+};
+
+/* Extract the planes from a projection * view (* model) matrix */
+Frustum extractFrustum(const glm::mat4& viewProjection);
+
+/* Bounding spheres in structure of arrays layout, padded to a multiple of 4
+* so they can be tested four at a time.
+*/
+struct BoundingSpheres {
+	std::vector<float> x, y, z, r;
+	size_t count = 0;
+
+	void resize(size_t n);
+	void set(size_t i, const AABB& box);
+};
+
+/* visible[i] is set to 1 when sphere i intersects the frustum, 0 otherwise */
+void cullSpheres(const Frustum& frustum, const BoundingSpheres& spheres,
+	std::vector<unsigned char>& visible);
+
+/* A contiguous range of leaf triangles that hang from the same bone */
+struct LeafCluster {
+	int bone;
+	GLint first;
+	GLsizei count;
+	AABB bindBounds;  // model space bounds at the binding pose
+};
+
+/* Group the leaf triangles by bone and grid cell and reorder the vertex
+* arrays so each cluster is a contiguous range. Every triangle takes the bone
+* of its first vertex so it moves rigidly.
+*/
+std::vector<LeafCluster> buildLeafClusters(
+	std::vector<glm::vec3>& vertices,
+	std::vector<glm::vec3>& normals,
+	std::vector<glm::vec2>& uvs,
+	std::vector<float>& boneIndices,
+	float cellSize);
+
+#endif
+//end of culling.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//culling.cpp
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define CULLING_SSE
+#endif
+
+void AABB::expand(const glm::vec3& p) {
+	min = glm::min(min, p);
+	max = glm::max(max, p);
+}
+
+void AABB::expand(const AABB& box) {
+	min = glm::min(min, box.min);
+	max = glm::max(max, box.max);
+}
+
+AABB transformAABB(const AABB& box, const glm::mat4& transformation) {
+	// Arvo's method: center transformed, extents through the absolute matrix
+	glm::vec3 center = (box.min + box.max) * 0.5f;
+	glm::vec3 extent = (box.max - box.min) * 0.5f;
+	glm::vec3 newCenter = glm::vec3(transformation * glm::vec4(center, 1.0f));
+	glm::vec3 newExtent;
+	for (int i = 0; i < 3; i++) {
+		newExtent[i] = fabs(transformation[0][i]) * extent.x +
+			fabs(transformation[1][i]) * extent.y +
+			fabs(transformation[2][i]) * extent.z;
+	}
+	return AABB{ newCenter - newExtent, newCenter + newExtent };
+}
+
+Frustum extractFrustum(const glm::mat4& m) {
+	Frustum frustum;
+	for (int i = 0; i < 3; i++) {
+		for (int s = 0; s < 2; s++) {
+			glm::vec4 plane;
+			for (int j = 0; j < 4; j++) {
+				float row3 = m[j][3], rowi = m[j][i];
+				plane[j] = s == 0 ? row3 + rowi : row3 - rowi;
+			}
+			float len = glm::length(glm::vec3(plane));
+			frustum.planes[2 * i + s] = plane / len;
+		}
+	}
+	return frustum;
+}
+
+void BoundingSpheres::resize(size_t n) {
+	count = n;
+	size_t padded = (n + 3) & ~(size_t)3;
+	x.assign(padded, 0); y.assign(padded, 0); z.assign(padded, 0); r.assign(padded, 0);
+}
+
+void BoundingSpheres::set(size_t i, const AABB& box) {
+	glm::vec3 c = (box.min + box.max) * 0.5f;
+	x[i] = c.x; y[i] = c.y; z[i] = c.z;
+	r[i] = glm::length(box.max - box.min) * 0.5f;
+}
+
+void cullSpheres(const Frustum& frustum, const BoundingSpheres& spheres,
+	std::vector<unsigned char>& visible) {
+	visible.resize(spheres.count);
+	size_t padded = spheres.x.size();
+#ifdef CULLING_SSE
+	for (size_t i = 0; i < padded; i += 4) {
+		__m128 cx = _mm_loadu_ps(&spheres.x[i]);
+		__m128 cy = _mm_loadu_ps(&spheres.y[i]);
+		__m128 cz = _mm_loadu_ps(&spheres.z[i]);
+		__m128 negR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.r[i]));
+		__m128 inside = _mm_cmpeq_ps(cx, cx);  // all bits set
+		for (int p = 0; p < 6; p++) {
+			const glm::vec4& plane = frustum.planes[p];
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negR));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (size_t k = 0; k < 4 && i + k < spheres.count; k++) {
+			visible[i + k] = (mask >> k) & 1;
+		}
+	}
+#else
+	for (size_t i = 0; i < spheres.count; i++) {
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++) {
+			const glm::vec4& plane = frustum.planes[p];
+			inside = plane.x * spheres.x[i] + plane.y * spheres.y[i] +
+				plane.z * spheres.z[i] + plane.w >= -spheres.r[i];
+		}
+		visible[i] = inside ? 1 : 0;
+	}
+#endif
+}
+
+std::vector<LeafCluster> buildLeafClusters(
+	std::vector<glm::vec3>& vertices,
+	std::vector<glm::vec3>& normals,
+	std::vector<glm::vec2>& uvs,
+	std::vector<float>& boneIndices,
+	float cellSize) {
+	size_t triangleCount = vertices.size() / 3;
+	std::vector<std::tuple<int, int, int, int, size_t>> keys(triangleCount);
+	for (size_t i = 0; i < triangleCount; i++) {
+		glm::vec3 c = (vertices[3 * i] + vertices[3 * i + 1] + vertices[3 * i + 2]) / 3.0f;
+		keys[i] = std::make_tuple((int)boneIndices[3 * i],
+			(int)floor(c.x / cellSize), (int)floor(c.y / cellSize), (int)floor(c.z / cellSize), i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<glm::vec3> sortedVertices(vertices.size()), sortedNormals(normals.size());
+	std::vector<glm::vec2> sortedUVs(uvs.size());
+	std::vector<float> sortedBones(boneIndices.size());
+	std::vector<LeafCluster> clusters;
+	for (size_t i = 0; i < triangleCount; i++) {
+		size_t src = std::get<4>(keys[i]);
+		bool newCluster = i == 0 ||
+			std::get<0>(keys[i]) != std::get<0>(keys[i - 1]) ||
+			std::get<1>(keys[i]) != std::get<1>(keys[i - 1]) ||
+			std::get<2>(keys[i]) != std::get<2>(keys[i - 1]) ||
+			std::get<3>(keys[i]) != std::get<3>(keys[i - 1]);
+		if (newCluster) {
+			LeafCluster cluster;
+			cluster.bone = std::get<0>(keys[i]);
+			cluster.first = (GLint)(3 * i);
+			cluster.count = 0;
+			cluster.bindBounds = AABB{ vertices[3 * src], vertices[3 * src] };
+			clusters.push_back(cluster);
+		}
+		LeafCluster& cluster = clusters.back();
+		for (int k = 0; k < 3; k++) {
+			sortedVertices[3 * i + k] = vertices[3 * src + k];
+			sortedNormals[3 * i + k] = normals[3 * src + k];
+			sortedUVs[3 * i + k] = uvs[3 * src + k];
+			sortedBones[3 * i + k] = (float)cluster.bone;
+			cluster.bindBounds.expand(vertices[3 * src + k]);
+		}
+		cluster.count += 3;
+	}
+	vertices.swap(sortedVertices);
+	normals.swap(sortedNormals);
+	uvs.swap(sortedUVs);
+	boneIndices.swap(sortedBones);
+	return clusters;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//parallel.h
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/* A fixed set of worker threads for data parallel loops. The calling thread
+* works as worker 0, so a pool of one thread runs everything inline.
+*/
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned int threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	unsigned int size() const { return (unsigned int)workers.size() + 1; }
+
+	/* Split [0, count) in one contiguous chunk per worker and call
+	* f(begin, end, worker) for each, returning when all chunks are done.
+	*/
+	void parallelFor(size_t count,
+		const std::function<void(size_t, size_t, unsigned int)>& f);
+
+private:
+	void workerLoop(unsigned int worker);
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start, done;
+	const std::function<void(size_t, size_t, unsigned int)>* job = NULL;
+	size_t jobCount = 0;
+	unsigned long long generation = 0;
+	unsigned int pending = 0;
+	bool stopping = false;
+};
+
+#endif
+//end of parallel.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//parallel.cpp
+ThreadPool::ThreadPool(unsigned int threadCount) {
+	if (threadCount == 0) threadCount = 1;
+	for (unsigned int i = 1; i < threadCount; i++) {
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	start.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::parallelFor(size_t count,
+	const std::function<void(size_t, size_t, unsigned int)>& f) {
+	if (workers.empty() || count < size()) {
+		f(0, count, 0);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &f;
+		jobCount = count;
+		pending = (unsigned int)workers.size();
+		generation++;
+	}
+	start.notify_all();
+
+	f(0, count / size(), 0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return pending == 0; });
+	job = NULL;
+}
+
+void ThreadPool::workerLoop(unsigned int worker) {
+	unsigned long long seen = 0;
+	while (true) {
+		const std::function<void(size_t, size_t, unsigned int)>* f;
+		size_t count;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+			f = job;
+			count = jobCount;
+		}
+		(*f)(count * worker / size(), count * (worker + 1) / size(), worker);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending--;
+		}
+		done.notify_one();
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//leafsort.h
+#ifndef LEAFSORT_H
+#define LEAFSORT_H
+
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+class ThreadPool;
+
+/* Scratch buffers reused from frame to frame */
+struct LeafSortScratch {
+	std::vector<float> depths;
+	std::vector<uint32_t> keys, tmpKeys;
+	std::vector<unsigned int> tmpOrder;
+	std::vector<size_t> histograms, counts;
+};
+
+/* Order the leaf triangles back to front. order holds the previous frame's
+* order and is updated in place: when it is still nearly sorted an insertion
+* sort per worker chunk finishes the job, otherwise (or once the insertion
+* sort has shifted too much) a parallel LSD radix sort on 16 bit quantized
+* view depth is used.
+*
+* centroids and bones are per triangle, depthRows[bone] is the third row of
+* view * model * skinning transformation of that bone.
+*/
+void sortLeavesBackToFront(
+	ThreadPool& pool,
+	const std::vector<glm::vec3>& centroids,
+	const std::vector<int>& bones,
+	const std::vector<glm::vec4>& depthRows,
+	std::vector<unsigned int>& order,
+	LeafSortScratch& scratch);
+
+/* Write the vertex indices of the ordered triangles whose cluster is visible */
+void writeLeafIndices(
+	ThreadPool& pool,
+	const std::vector<unsigned int>& order,
+	const std::vector<int>& triangleClusters,
+	const std::vector<unsigned char>& clusterVisible,
+	std::vector<unsigned int>& indices,
+	LeafSortScratch& scratch);
+
+#endif
+//end of leafsort.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//leafsort.cpp
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define DEPTH_KEY_BITS 16
+
+static void parallelRadixSort(ThreadPool& pool, std::vector<uint32_t>& keys,
+	std::vector<unsigned int>& values, LeafSortScratch& scratch) {
+	size_t n = keys.size();
+	unsigned int workers = pool.size();
+	scratch.tmpKeys.resize(n);
+	scratch.tmpOrder.resize(n);
+	scratch.histograms.resize(workers * RADIX_BUCKETS);
+
+	for (int shift = 0; shift < DEPTH_KEY_BITS; shift += RADIX_BITS) {
+		std::fill(scratch.histograms.begin(), scratch.histograms.end(), 0);
+
+		// per worker histograms of its own chunk
+		pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+			size_t* histogram = &scratch.histograms[worker * RADIX_BUCKETS];
+			for (size_t i = begin; i < end; i++) {
+				histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+			}
+		});
+
+		// bucket major, worker minor offsets keep the sort stable
+		size_t offset = 0;
+		for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+			for (unsigned int worker = 0; worker < workers; worker++) {
+				size_t count = scratch.histograms[worker * RADIX_BUCKETS + bucket];
+				scratch.histograms[worker * RADIX_BUCKETS + bucket] = offset;
+				offset += count;
+			}
+		}
+
+		pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+			size_t* offsets = &scratch.histograms[worker * RADIX_BUCKETS];
+			for (size_t i = begin; i < end; i++) {
+				size_t dst = offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+				scratch.tmpKeys[dst] = keys[i];
+				scratch.tmpOrder[dst] = values[i];
+			}
+		});
+		keys.swap(scratch.tmpKeys);
+		values.swap(scratch.tmpOrder);
+	}
+}
+
+// move element i back to its place, no further than first; false, with the
+// element left where it got to, once budget shifts are spent
+static bool insertKey(std::vector<uint32_t>& keys, std::vector<unsigned int>& values,
+	size_t i, size_t first, size_t& budget) {
+	uint32_t key = keys[i];
+	unsigned int value = values[i];
+	bool placed = true;
+	while (i > first && keys[i - 1] > key) {
+		if (budget == 0) {
+			placed = false;
+			break;
+		}
+		budget--;
+		keys[i] = keys[i - 1];
+		values[i] = values[i - 1];
+		i--;
+	}
+	keys[i] = key;
+	values[i] = value;
+	return placed;
+}
+
+void sortLeavesBackToFront(
+	ThreadPool& pool,
+	const std::vector<glm::vec3>& centroids,
+	const std::vector<int>& bones,
+	const std::vector<glm::vec4>& depthRows,
+	std::vector<unsigned int>& order,
+	LeafSortScratch& scratch) {
+	size_t n = centroids.size();
+	if (order.size() != n) {
+		order.resize(n);
+		for (size_t i = 0; i < n; i++) order[i] = (unsigned int)i;
+	}
+	if (n == 0) return;
+
+	// quantized view depth per triangle, streaming through the centroids
+	std::vector<float>& depths = scratch.depths;
+	depths.resize(n);
+	std::vector<float> depthMin(pool.size(), FLT_MAX), depthMax(pool.size(), -FLT_MAX);
+	pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+		float lo = FLT_MAX, hi = -FLT_MAX;
+		for (size_t tri = begin; tri < end; tri++) {
+			float z = glm::dot(depthRows[bones[tri]], glm::vec4(centroids[tri], 1.0f));
+			depths[tri] = z;
+			lo = std::min(lo, z);
+			hi = std::max(hi, z);
+		}
+		depthMin[worker] = lo;
+		depthMax[worker] = hi;
+	});
+	float zMin = *std::min_element(depthMin.begin(), depthMin.end());
+	float zMax = *std::max_element(depthMax.begin(), depthMax.end());
+
+	// keys in the previous order: the farthest triangle (most negative z) gets
+	// the smallest key
+	std::vector<uint32_t>& keys = scratch.keys;
+	keys.resize(n);
+	float scale = zMax > zMin ? ((1 << DEPTH_KEY_BITS) - 1) / (zMax - zMin) : 0.0f;
+	std::vector<size_t> descents(pool.size(), 0);
+	pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+		uint32_t previous = 0;
+		for (size_t i = begin; i < end; i++) {
+			keys[i] = (uint32_t)((depths[order[i]] - zMin) * scale);
+			if (i > begin && keys[i] < previous) descents[worker]++;
+			previous = keys[i];
+		}
+	});
+	size_t unsorted = 0;
+	for (size_t d : descents) unsorted += d;
+	for (unsigned int worker = 1; worker < pool.size(); worker++) {
+		size_t boundary = n * worker / pool.size();
+		if (boundary > 0 && boundary < n && keys[boundary] < keys[boundary - 1]) unsorted++;
+	}
+
+	if (unsorted == 0) return;
+	if (unsorted < n / 64) {
+		// the camera and the tree barely moved: finish the previous order, each
+		// worker its own chunk, then the few triangles crossing the chunk
+		// boundaries. A swinging branch moves its leaves far, so the shifts are
+		// capped at about a radix pass worth of moves and the radix sort takes
+		// over from wherever the insertion sort stopped
+		std::vector<unsigned char> finished(pool.size(), 1);
+		pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+			size_t budget = (end - begin) / 8;
+			for (size_t i = begin + 1; i < end && finished[worker]; i++) {
+				finished[worker] = insertKey(keys, order, i, begin, budget);
+			}
+		});
+		bool sorted = std::find(finished.begin(), finished.end(), 0) == finished.end();
+		size_t budget = n / 64;
+		for (unsigned int worker = 1; sorted && worker < pool.size(); worker++) {
+			// the chunk is sorted, only a prefix of it is below the sorted part
+			// before it
+			size_t end = n * (worker + 1) / pool.size();
+			for (size_t i = n * worker / pool.size(); sorted && i > 0 && i < end &&
+				keys[i] < keys[i - 1]; i++) {
+				sorted = insertKey(keys, order, i, 0, budget);
+			}
+		}
+		if (sorted) return;
+	}
+	parallelRadixSort(pool, keys, order, scratch);
+}
+
+void writeLeafIndices(
+	ThreadPool& pool,
+	const std::vector<unsigned int>& order,
+	const std::vector<int>& triangleClusters,
+	const std::vector<unsigned char>& clusterVisible,
+	std::vector<unsigned int>& indices,
+	LeafSortScratch& scratch) {
+	size_t n = order.size();
+	unsigned int workers = pool.size();
+
+	// count the visible triangles of each chunk, then write them in place
+	scratch.counts.assign(workers + 1, 0);
+	pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+		size_t count = 0;
+		for (size_t i = begin; i < end; i++) {
+			if (clusterVisible[triangleClusters[order[i]]]) count++;
+		}
+		scratch.counts[worker + 1] = count;
+	});
+	for (unsigned int worker = 0; worker < workers; worker++) {
+		scratch.counts[worker + 1] += scratch.counts[worker];
+	}
+	indices.resize(3 * scratch.counts[workers]);
+	pool.parallelFor(n, [&](size_t begin, size_t end, unsigned int worker) {
+		size_t dst = 3 * scratch.counts[worker];
+		for (size_t i = begin; i < end; i++) {
+			unsigned int tri = order[i];
+			if (!clusterVisible[triangleClusters[tri]]) continue;
+			indices[dst++] = 3 * tri;
+			indices[dst++] = 3 * tri + 1;
+			indices[dst++] = 3 * tri + 2;
+		}
+	});
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+//dynamics.h
+#ifndef DYNAMICS_H
+#define DYNAMICS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define SNAPSHOT_VERSION 2
+
+/* Wind and material parameters of the coordinate dynamics */
+struct DynamicsParameters {
+	float windSpeed = 1.0f;  // mean wind speed
+	float gustiness = 0.5f;  // gust strength relative to the mean
+	float gustTime = 2.0f;  // seconds a gust takes to die out
+	float stiffness = 40.0f;  // restoring torque per degree
+	float damping = 4.0f;
+	float timeStep = 1.0f / 120.0f;
+	float contactStiffness = 2.0e5f;  // force per unit of penetration
+};
+
+/* Everything a run evolves, indexed by coordinate. It holds plain values
+* only, so stepping from a copy reproduces the run exactly.
+*/
+struct SimulationState {
+	uint64_t step = 0;
+	double time = 0.0;
+	uint64_t rngState = 1;
+	float wind = 0.0f;  // current wind speed, gusts included
+	std::vector<float> q, qdot;
+	std::vector<float> rest;  // coordinates at rest
+	std::vector<float> windResponse;  // torque per unit of wind pressure
+
+	// generalized forces (e.g. contacts) the caller computes from q before
+	// every step, so they are not part of snapshots
+	std::vector<float> externalForce;
+};
+
+/* Advance the state by one fixed time step: every coordinate is a damped
+* spring around its rest value, loaded by a gusting wind
+*/
+void stepSimulation(SimulationState& state, const DynamicsParameters& parameters);
+
+/* Serialize the state and its parameters into a versioned blob */
+void saveSnapshot(const SimulationState& state, const DynamicsParameters& parameters,
+	std::vector<unsigned char>& blob);
+
+/* Restore a blob written by saveSnapshot, throws if it is corrupt or of
+* another version
+*/
+void loadSnapshot(const std::vector<unsigned char>& blob, SimulationState& state,
+	DynamicsParameters& parameters);
+
+/* Writes snapshots to a file on a background thread. take() copies the
+* state into whichever of two buffers the writer is not using, so the
+* simulation never waits for serialization or the disk. Snapshots go to a
+* temporary file first, so a crash never leaves a partial one behind.
+*/
+class SnapshotWriter {
+public:
+	explicit SnapshotWriter(const std::string& path);
+	~SnapshotWriter();
+
+	void take(const SimulationState& state, const DynamicsParameters& parameters);
+
+private:
+	SnapshotWriter(const SnapshotWriter&);
+	SnapshotWriter& operator=(const SnapshotWriter&);
+
+	void writerLoop();
+
+	std::string path;
+	SimulationState states[2];
+	DynamicsParameters parameters[2];
+	int pending, writing;  // buffer waiting for / being written, -1 if none
+	bool stop;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::thread thread;
+};
+
+#endif
+//end of dynamics.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//dynamics.cpp
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdexcept>
+
+static const char snapshotMagic[4] = { 'T', 'S', 'N', 'P' };
+
+static uint64_t nextRandom(uint64_t& state) {
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+static float gaussianRandom(uint64_t& state) {
+	// Box-Muller, the uniform is kept away from zero for the log
+	float u1 = ((nextRandom(state) >> 40) + 1) / 16777217.0f;
+	float u2 = (nextRandom(state) >> 40) / 16777216.0f;
+	return sqrtf(-2.0f * logf(u1)) * cosf(6.28318531f * u2);
+}
+
+void stepSimulation(SimulationState& state, const DynamicsParameters& parameters) {
+	float dt = parameters.timeStep;
+
+	// Ornstein-Uhlenbeck gusts around the mean speed
+	state.wind += (parameters.windSpeed - state.wind) * dt / parameters.gustTime +
+		parameters.gustiness * parameters.windSpeed * sqrtf(dt) *
+		gaussianRandom(state.rngState);
+	float pressure = state.wind * fabsf(state.wind);
+
+	// semi-implicit Euler
+	const float* external = state.externalForce.size() == state.q.size() ?
+		state.externalForce.data() : NULL;
+	for (size_t i = 0; i < state.q.size(); i++) {
+		float torque = state.windResponse[i] * pressure -
+			parameters.stiffness * (state.q[i] - state.rest[i]) -
+			parameters.damping * state.qdot[i];
+		if (external != NULL) torque += external[i];
+		state.qdot[i] += torque * dt;
+		state.q[i] += state.qdot[i] * dt;
+	}
+	state.step++;
+	state.time += dt;
+}
+
+static uint32_t snapshotChecksum(const unsigned char* data, size_t size) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+template<class T>
+static void putValue(std::vector<unsigned char>& blob, const T& value) {
+	const unsigned char* bytes = (const unsigned char*)&value;
+	blob.insert(blob.end(), bytes, bytes + sizeof(T));
+}
+
+template<class T>
+static void getValue(const std::vector<unsigned char>& blob, size_t& offset, T& value) {
+	if (offset + sizeof(T) > blob.size()) {
+		throw std::runtime_error("Truncated snapshot\n");
+	}
+	memcpy(&value, &blob[offset], sizeof(T));
+	offset += sizeof(T);
+}
+
+void saveSnapshot(const SimulationState& state, const DynamicsParameters& parameters,
+	std::vector<unsigned char>& blob) {
+	// magic, version, coordinate count, checksum of everything after it
+	blob.clear();
+	blob.insert(blob.end(), snapshotMagic, snapshotMagic + 4);
+	putValue(blob, (uint32_t)SNAPSHOT_VERSION);
+	putValue(blob, (uint32_t)state.q.size());
+	putValue(blob, (uint32_t)0);
+	size_t payload = blob.size();
+
+	putValue(blob, parameters);
+	putValue(blob, state.step);
+	putValue(blob, state.time);
+	putValue(blob, state.rngState);
+	putValue(blob, state.wind);
+	for (const std::vector<float>* v : { &state.q, &state.qdot, &state.rest, &state.windResponse }) {
+		for (float value : *v) putValue(blob, value);
+	}
+
+	uint32_t checksum = snapshotChecksum(&blob[payload], blob.size() - payload);
+	memcpy(&blob[payload - sizeof(uint32_t)], &checksum, sizeof(uint32_t));
+}
+
+void loadSnapshot(const std::vector<unsigned char>& blob, SimulationState& state,
+	DynamicsParameters& parameters) {
+	uint32_t version, coordinates, checksum;
+	size_t offset = 4;
+	if (blob.size() < 4 || memcmp(&blob[0], snapshotMagic, 4) != 0) {
+		throw std::runtime_error("Not a snapshot\n");
+	}
+	getValue(blob, offset, version);
+	getValue(blob, offset, coordinates);
+	getValue(blob, offset, checksum);
+	if (version != SNAPSHOT_VERSION) {
+		throw std::runtime_error("Unsupported snapshot version\n");
+	}
+	if (snapshotChecksum(&blob[0] + offset, blob.size() - offset) != checksum) {
+		throw std::runtime_error("Corrupt snapshot\n");
+	}
+
+	// decode into a copy so a failure leaves the running state untouched
+	SimulationState restored;
+	DynamicsParameters restoredParameters;
+	getValue(blob, offset, restoredParameters);
+	getValue(blob, offset, restored.step);
+	getValue(blob, offset, restored.time);
+	getValue(blob, offset, restored.rngState);
+	getValue(blob, offset, restored.wind);
+	// the count is checked against the bytes left before anything is sized by it
+	if (coordinates > (blob.size() - offset) / (4 * sizeof(float))) {
+		throw std::runtime_error("Truncated snapshot\n");
+	}
+	for (std::vector<float>* v : { &restored.q, &restored.qdot, &restored.rest,
+		&restored.windResponse }) {
+		v->resize(coordinates);
+		for (float& value : *v) getValue(blob, offset, value);
+	}
+	state = restored;
+	parameters = restoredParameters;
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path) : path(path), pending(-1),
+	writing(-1), stop(false) {
+	thread = std::thread(&SnapshotWriter::writerLoop, this);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+void SnapshotWriter::take(const SimulationState& state, const DynamicsParameters& parameters) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// a snapshot not picked up yet is simply replaced by the newer one
+		int buffer = pending >= 0 ? pending : (writing == 0 ? 1 : 0);
+		states[buffer] = state;
+		this->parameters[buffer] = parameters;
+		pending = buffer;
+	}
+	wake.notify_one();
+}
+
+void SnapshotWriter::writerLoop() {
+	std::vector<unsigned char> blob;
+	std::string temporary = path + ".tmp";
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this] { return stop || pending >= 0; });
+		// flush the last snapshot before stopping
+		if (pending < 0) return;
+		writing = pending;
+		pending = -1;
+		lock.unlock();
+
+		saveSnapshot(states[writing], parameters[writing], blob);
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file != NULL) {
+			bool written = fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+			written = fclose(file) == 0 && written;
+			if (written) {
+				// rename does not replace an existing file on Windows
+				remove(path.c_str());
+				rename(temporary.c_str(), path.c_str());
+			}
+		}
+
+		lock.lock();
+		writing = -1;
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//sweep.h
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <string>
+#include <vector>
+
+#define SWEEP_VERSION 1
+
+/* A swept DynamicsParameters member and the values it takes */
+struct SweepAxis {
+	std::string name;
+	float DynamicsParameters::* parameter;
+	std::vector<float> values;
+};
+
+/* How every run of a sweep is loaded and measured. The wind blows for
+* loadDuration, then stops and the tree is left to settle.
+*/
+struct SweepSettings {
+	float loadDuration = 20.0f;
+	float releaseDuration = 20.0f;
+	float settleTolerance = 0.5f;  // degrees from rest that count as settled
+	std::vector<int> rootCoordinates;  // coordinates of the joint at the base
+	unsigned int rowGroupSize = 1024;
+};
+
+struct SweepResult {
+	float peakDeflection;  // largest coordinate deviation from rest, degrees
+	float peakRootMoment;  // largest restoring moment at the base joint
+	float settleTime;  // seconds after the release, infinite if never settled
+};
+
+/* Parse "name=v0,v1,..." or "name=first:last:count", throws on an unknown
+* parameter
+*/
+SweepAxis parseSweepAxis(const std::string& spec);
+
+/* Run one simulation from the given state and measure it */
+SweepResult simulateSweepRun(SimulationState state, DynamicsParameters parameters,
+	const SweepSettings& settings);
+
+/* Run every combination of the axes values, spread over the pool one whole
+* run per task so its state stays in the worker's cache. Results are
+* written to path a row group at a time, as columns: the axes values then
+* the three measurements. Returns the number of runs.
+*/
+size_t runParameterSweep(ThreadPool& pool, const SimulationState& initial,
+	const DynamicsParameters& base, const std::vector<SweepAxis>& axes,
+	const SweepSettings& settings, const std::string& path);
+
+#endif
+//end of sweep.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//sweep.cpp
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdexcept>
+
+static const struct {
+	const char* name;
+	float DynamicsParameters::* parameter;
+} sweepParameters[] = {
+	{ "wind", &DynamicsParameters::windSpeed },
+	{ "gustiness", &DynamicsParameters::gustiness },
+	{ "gustTime", &DynamicsParameters::gustTime },
+	{ "stiffness", &DynamicsParameters::stiffness },
+	{ "damping", &DynamicsParameters::damping }
+};
+
+SweepAxis parseSweepAxis(const std::string& spec) {
+	size_t equals = spec.find('=');
+	if (equals == std::string::npos) {
+		throw std::runtime_error("Expected name=values in sweep " + spec + "\n");
+	}
+	SweepAxis axis;
+	axis.name = spec.substr(0, equals);
+	axis.parameter = NULL;
+	for (const auto& p : sweepParameters) {
+		if (axis.name == p.name) axis.parameter = p.parameter;
+	}
+	if (axis.parameter == NULL) {
+		throw std::runtime_error("Unknown sweep parameter " + axis.name + "\n");
+	}
+
+	std::string values = spec.substr(equals + 1);
+	float first, last;
+	int count;
+	if (sscanf(values.c_str(), "%f:%f:%d", &first, &last, &count) == 3) {
+		for (int i = 0; i < count; i++) {
+			axis.values.push_back(count > 1 ? first + (last - first) * i / (count - 1) : first);
+		}
+	}
+	else {
+		const char* cursor = values.c_str();
+		char* end;
+		while (*cursor != '\0') {
+			axis.values.push_back(strtof(cursor, &end));
+			if (end == cursor) break;
+			cursor = *end == ',' ? end + 1 : end;
+		}
+	}
+	if (axis.values.empty()) {
+		throw std::runtime_error("No values in sweep " + spec + "\n");
+	}
+	return axis;
+}
+
+SweepResult simulateSweepRun(SimulationState state, DynamicsParameters parameters,
+	const SweepSettings& settings) {
+	SweepResult result = { 0.0f, 0.0f, 0.0f };
+	int loadSteps = (int)(settings.loadDuration / parameters.timeStep + 0.5f);
+	int releaseSteps = (int)(settings.releaseDuration / parameters.timeStep + 0.5f);
+	int lastUnsettled = -1;
+
+	for (int step = 0; step < loadSteps + releaseSteps; step++) {
+		if (step == loadSteps) {
+			parameters.windSpeed = 0.0f;
+			parameters.gustiness = 0.0f;
+		}
+		stepSimulation(state, parameters);
+
+		float deflection = 0.0f;
+		for (size_t i = 0; i < state.q.size(); i++) {
+			deflection = fmaxf(deflection, fabsf(state.q[i] - state.rest[i]));
+		}
+		float moment = 0.0f;
+		for (int i : settings.rootCoordinates) {
+			float d = state.q[i] - state.rest[i];
+			moment += d * d;
+		}
+		result.peakDeflection = fmaxf(result.peakDeflection, deflection);
+		result.peakRootMoment = fmaxf(result.peakRootMoment,
+			parameters.stiffness * sqrtf(moment));
+		if (step >= loadSteps && deflection > settings.settleTolerance) {
+			lastUnsettled = step - loadSteps;
+		}
+	}
+
+	if (lastUnsettled == releaseSteps - 1) {
+		result.settleTime = INFINITY;
+	}
+	else {
+		result.settleTime = (lastUnsettled + 1) * parameters.timeStep;
+	}
+	return result;
+}
+
+static void writeSweepHeader(FILE* file, const std::vector<std::string>& columns,
+	uint64_t rows) {
+	// magic, version, column count, row count, then the column names
+	fwrite("TSWP", 1, 4, file);
+	uint32_t version = SWEEP_VERSION, columnCount = (uint32_t)columns.size();
+	fwrite(&version, sizeof(version), 1, file);
+	fwrite(&columnCount, sizeof(columnCount), 1, file);
+	fwrite(&rows, sizeof(rows), 1, file);
+	for (const auto& name : columns) {
+		uint32_t length = (uint32_t)name.size();
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(name.data(), 1, length, file);
+	}
+}
+
+size_t runParameterSweep(ThreadPool& pool, const SimulationState& initial,
+	const DynamicsParameters& base, const std::vector<SweepAxis>& axes,
+	const SweepSettings& settings, const std::string& path) {
+	size_t runs = 1;
+	std::vector<std::string> columns;
+	for (const auto& axis : axes) {
+		runs *= axis.values.size();
+		columns.push_back(axis.name);
+	}
+	columns.push_back("peakDeflection");
+	columns.push_back("peakRootMoment");
+	columns.push_back("settleTime");
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) {
+		throw std::runtime_error("Failed to create " + path + "\n");
+	}
+	writeSweepHeader(file, columns, 0);
+
+	// one column after the other for each row group
+	size_t groupSize = settings.rowGroupSize > 0 ? settings.rowGroupSize : runs;
+	std::vector<float> group(columns.size() * groupSize);
+	for (size_t first = 0; first < runs; first += groupSize) {
+		size_t rows = std::min(groupSize, runs - first);
+		pool.parallelFor(rows, [&](size_t begin, size_t end, unsigned int) {
+			for (size_t row = begin; row < end; row++) {
+				// last axis varies fastest
+				DynamicsParameters parameters = base;
+				size_t run = first + row;
+				for (size_t a = axes.size(); a-- > 0;) {
+					const SweepAxis& axis = axes[a];
+					group[a * rows + row] = parameters.*axis.parameter =
+						axis.values[run % axis.values.size()];
+					run /= axis.values.size();
+				}
+				SweepResult result = simulateSweepRun(initial, parameters, settings);
+				group[axes.size() * rows + row] = result.peakDeflection;
+				group[(axes.size() + 1) * rows + row] = result.peakRootMoment;
+				group[(axes.size() + 2) * rows + row] = result.settleTime;
+			}
+		});
+
+		uint32_t groupRows = (uint32_t)rows;
+		fwrite(&groupRows, sizeof(groupRows), 1, file);
+		fwrite(group.data(), sizeof(float), rows * columns.size(), file);
+	}
+
+	// patch the row count now that the file is complete
+	fseek(file, 0, SEEK_SET);
+	writeSweepHeader(file, columns, runs);
+	fclose(file);
+	return runs;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//collision.h
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#include <vector>
+#include <utility>
+#include <glm/glm.hpp>
+
+/* Proxy of a bone: the points within radius of the segment a-b */
+struct Capsule {
+	glm::vec3 a, b;
+	float radius;
+	int tree;
+	int bone;
+	// bones of the same tree this one never collides with (e.g. touching it
+	// at rest), one bit per bone
+	unsigned int ignoredBones;
+};
+
+/* Penalty force pushing a capsule out of the ground or another capsule */
+struct Contact {
+	unsigned int capsule;
+	glm::vec3 point, force;
+};
+
+/* Sweep and prune broadphase on the x axis. The capsules stay sorted by
+* their lower bound between updates, so with coherent motion the insertion
+* sort does close to linear work and so does the sweep for sparse scenes.
+*/
+class SweepAndPrune {
+public:
+	/* Re-sort the capsules and return the pairs whose bounding boxes overlap */
+	const std::vector<std::pair<unsigned int, unsigned int> >& update(
+		const std::vector<Capsule>& capsules);
+
+private:
+	std::vector<AABB> boxes;
+	std::vector<unsigned int> order;
+	std::vector<float> keys;  // boxes[order[i]].min.x
+	std::vector<std::pair<unsigned int, unsigned int> > pairs;
+};
+
+/* Closest points of the segments p0-p1 and q0-q1 */
+void closestPointsSegmentSegment(const glm::vec3& p0, const glm::vec3& p1,
+	const glm::vec3& q0, const glm::vec3& q1, glm::vec3& p, glm::vec3& q);
+
+/* Contacts of the capsules with the ground plane (a, b, c, d with the normal
+* pointing out of the ground) and with each other. The force is stiffness
+* times the penetration depth.
+*/
+void findContacts(const std::vector<Capsule>& capsules, SweepAndPrune& broadphase,
+	const glm::vec4& ground, float stiffness, std::vector<Contact>& contacts);
+
+#endif
+//end of collision.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//collision.cpp
+const std::vector<std::pair<unsigned int, unsigned int> >& SweepAndPrune::update(
+	const std::vector<Capsule>& capsules) {
+	size_t n = capsules.size();
+	boxes.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		const Capsule& c = capsules[i];
+		boxes[i].min = glm::min(c.a, c.b) - glm::vec3(c.radius);
+		boxes[i].max = glm::max(c.a, c.b) + glm::vec3(c.radius);
+	}
+
+	// a different capsule set starts over from the identity order
+	if (order.size() != n) {
+		order.resize(n);
+		for (size_t i = 0; i < n; i++) order[i] = (unsigned int)i;
+	}
+	keys.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = boxes[order[i]].min.x;
+	}
+	for (size_t i = 1; i < n; i++) {
+		float key = keys[i];
+		unsigned int capsule = order[i];
+		size_t j = i;
+		for (; j > 0 && keys[j - 1] > key; j--) {
+			keys[j] = keys[j - 1];
+			order[j] = order[j - 1];
+		}
+		keys[j] = key;
+		order[j] = capsule;
+	}
+
+	pairs.clear();
+	for (size_t i = 0; i < n; i++) {
+		const AABB& a = boxes[order[i]];
+		for (size_t j = i + 1; j < n && keys[j] <= a.max.x; j++) {
+			const AABB& b = boxes[order[j]];
+			if (a.max.y < b.min.y || b.max.y < a.min.y ||
+				a.max.z < b.min.z || b.max.z < a.min.z) continue;
+			pairs.push_back(std::make_pair(order[i], order[j]));
+		}
+	}
+	return pairs;
+}
+
+void closestPointsSegmentSegment(const glm::vec3& p0, const glm::vec3& p1,
+	const glm::vec3& q0, const glm::vec3& q1, glm::vec3& p, glm::vec3& q) {
+	// Ericson, Real-Time Collision Detection 5.1.9
+	glm::vec3 d1 = p1 - p0, d2 = q1 - q0, r = p0 - q0;
+	float a = glm::dot(d1, d1), e = glm::dot(d2, d2), f = glm::dot(d2, r);
+	float s = 0.0f, t = 0.0f;
+	if (a <= 1e-12f && e <= 1e-12f) {
+		// both degenerate
+	}
+	else if (a <= 1e-12f) {
+		t = glm::clamp(f / e, 0.0f, 1.0f);
+	}
+	else {
+		float c = glm::dot(d1, r);
+		if (e <= 1e-12f) {
+			s = glm::clamp(-c / a, 0.0f, 1.0f);
+		}
+		else {
+			float b = glm::dot(d1, d2), denom = a * e - b * b;
+			s = denom > 0.0f ? glm::clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+			t = (b * s + f) / e;
+			if (t < 0.0f) {
+				t = 0.0f;
+				s = glm::clamp(-c / a, 0.0f, 1.0f);
+			}
+			else if (t > 1.0f) {
+				t = 1.0f;
+				s = glm::clamp((b - c) / a, 0.0f, 1.0f);
+			}
+		}
+	}
+	p = p0 + d1 * s;
+	q = q0 + d2 * t;
+}
+
+void findContacts(const std::vector<Capsule>& capsules, SweepAndPrune& broadphase,
+	const glm::vec4& ground, float stiffness, std::vector<Contact>& contacts) {
+	contacts.clear();
+
+	// the deepest point of a capsule in a plane is at one of its ends
+	glm::vec3 up(ground);
+	for (unsigned int i = 0; i < capsules.size(); i++) {
+		const Capsule& c = capsules[i];
+		for (const glm::vec3& end : { c.a, c.b }) {
+			float distance = glm::dot(up, end) + ground.w;
+			if (distance < c.radius) {
+				contacts.push_back(Contact{ i, end - up * distance,
+					up * (stiffness * (c.radius - distance)) });
+			}
+		}
+	}
+
+	for (const auto& pair : broadphase.update(capsules)) {
+		const Capsule& c0 = capsules[pair.first];
+		const Capsule& c1 = capsules[pair.second];
+		if (c0.tree == c1.tree && (c0.ignoredBones >> c1.bone & 1)) continue;
+
+		glm::vec3 p, q;
+		closestPointsSegmentSegment(c0.a, c0.b, c1.a, c1.b, p, q);
+		glm::vec3 d = p - q;
+		float distance = glm::length(d);
+		float depth = c0.radius + c1.radius - distance;
+		if (depth <= 0.0f) continue;
+
+		glm::vec3 normal = distance > 1e-6f ? d / distance : up;
+		glm::vec3 point = (p + q) * 0.5f;
+		contacts.push_back(Contact{ pair.first, point, normal * (stiffness * depth) });
+		contacts.push_back(Contact{ pair.second, point, normal * (-stiffness * depth) });
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//shaderprogram.h
+#ifndef SHADERPROGRAM_H
+#define SHADERPROGRAM_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <string>
+
+// variant bits, each one a #define in both shader stages
+#define SHADER_SKINNING 1
+#define SHADER_TEXTURED 2
+#define SHADER_SHADOWED 4
+#define SHADER_FEEDBACK 8  // captures the skinned vertices, see SkinnedMesh
+#define SHADER_VARIANTS 16
+#define MAX_BONES 12  // size of the boneTransformations palette
+
+/* A linked variant of the standard shader and its uniform locations */
+struct ShaderProgram {
+	GLuint program = 0;
+	unsigned int variant = 0;
+
+	GLint M = -1, V = -1, P = -1, lightVP = -1;
+	GLint Ka = -1, Kd = -1, Ks = -1, Ns = -1;
+	GLint La = -1, Ld = -1, Ls = -1, lightPosition = -1, lightPower = -1;
+	GLint diffuseSampler = -1, specularSampler = -1, shadowMapSampler = -1;
+	GLint planeCoeffs = -1;
+	GLint boneTransformations[MAX_BONES];
+
+	// bone palette last uploaded to this program, uniforms are per program
+	unsigned int paletteId = 0, paletteRevision = 0;
+};
+
+/* The #defines selecting a variant */
+std::string shaderVariantDefines(unsigned int variant);
+
+/* Link a variant of the given sources. Programs are cached on disk as
+* program binaries (cachePrefix + key + ".programbinary"), keyed by a hash
+* of the sources, the variant and the driver, so a warm start links
+* without compiling. Throws if the shaders do not compile or link.
+*/
+ShaderProgram loadShaderVariant(const std::string& vertexSource,
+	const std::string& fragmentSource, unsigned int variant,
+	const std::string& cachePrefix);
+
+std::string readTextFile(const std::string& path);
+
+#endif
+//end of shaderprogram.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//shaderprogram.cpp
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+
+#define PROGRAM_BINARY_MAGIC 0x4e494250  // "PBIN"
+
+struct ProgramBinaryHeader {
+	uint32_t magic;
+	uint32_t format;
+	uint64_t key;
+};
+
+std::string shaderVariantDefines(unsigned int variant) {
+	std::string defines = "#define MAX_BONES " + std::to_string(MAX_BONES) + "\n";
+	if (variant & SHADER_SKINNING) defines += "#define SKINNING\n";
+	if (variant & SHADER_TEXTURED) defines += "#define TEXTURED\n";
+	if (variant & SHADER_SHADOWED) defines += "#define SHADOWED\n";
+	if (variant & SHADER_FEEDBACK) defines += "#define FEEDBACK\n";
+	return defines;
+}
+
+std::string readTextFile(const std::string& path) {
+	MappedFile file;
+	file.open(path);
+	return std::string((const char*)file.data(), file.size());
+}
+
+static uint64_t hashBytes(uint64_t hash, const std::string& bytes) {
+	// FNV-1a, the terminator keeps "ab" + "c" apart from "a" + "bc"
+	for (size_t i = 0; i <= bytes.size(); i++) {
+		hash = (hash ^ (unsigned char)bytes.c_str()[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static std::string injectDefines(const std::string& source, const std::string& defines) {
+	// right after #version, #line keeps the compiler messages on the file lines
+	size_t version = source.find("#version");
+	size_t end = version == std::string::npos ? std::string::npos : source.find('\n', version);
+	if (end == std::string::npos) {
+		return defines + "#line 1\n" + source;
+	}
+	int line = 2;
+	for (size_t i = 0; i < end; i++) {
+		if (source[i] == '\n') line++;
+	}
+	return source.substr(0, end + 1) + defines + "#line " + std::to_string(line) + "\n" +
+		source.substr(end + 1);
+}
+
+static GLuint compileShader(GLenum type, const std::string& source) {
+	GLuint shader = glCreateShader(type);
+	const char* text = source.c_str();
+	glShaderSource(shader, 1, &text, NULL);
+	glCompileShader(shader);
+
+	GLint status, length;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::vector<char> log(length + 1, '\0');
+		glGetShaderInfoLog(shader, length, NULL, log.data());
+		glDeleteShader(shader);
+		throw std::runtime_error(std::string("Failed to compile shader\n") + log.data());
+	}
+	return shader;
+}
+
+static bool loadProgramBinary(GLuint program, const std::string& path, uint64_t key) {
+	MappedFile file;
+	try {
+		file.open(path);
+	}
+	catch (std::exception&) {
+		return false;
+	}
+	ProgramBinaryHeader header;
+	if (file.size() <= sizeof(header)) return false;
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != PROGRAM_BINARY_MAGIC || header.key != key) return false;
+
+	// a driver update may reject the binary, then the caller compiles
+	glProgramBinary(program, header.format, file.data() + sizeof(header),
+		(GLsizei)(file.size() - sizeof(header)));
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	return status == GL_TRUE;
+}
+
+static void saveProgramBinary(GLuint program, const std::string& path, uint64_t key) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	std::vector<unsigned char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+	ProgramBinaryHeader header = { PROGRAM_BINARY_MAGIC, format, key };
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) return;  // the cache is optional
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(binary.data(), 1, binary.size(), file);
+	fclose(file);
+}
+
+ShaderProgram loadShaderVariant(const std::string& vertexSource,
+	const std::string& fragmentSource, unsigned int variant,
+	const std::string& cachePrefix) {
+	std::string defines = shaderVariantDefines(variant);
+
+	GLint binaryFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+	uint64_t key = 14695981039346656037ULL;
+	key = hashBytes(key, defines);
+	key = hashBytes(key, vertexSource);
+	key = hashBytes(key, fragmentSource);
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+		const GLubyte* value = glGetString(name);
+		key = hashBytes(key, value != NULL ? (const char*)value : "");
+	}
+	char keyText[17];
+	snprintf(keyText, sizeof(keyText), "%016llx", (unsigned long long)key);
+	std::string cachePath = cachePrefix + keyText + ".programbinary";
+
+	ShaderProgram shader;
+	shader.variant = variant;
+	shader.program = glCreateProgram();
+	if (binaryFormats == 0 || !loadProgramBinary(shader.program, cachePath, key)) {
+		GLuint vertex = compileShader(GL_VERTEX_SHADER, injectDefines(vertexSource, defines));
+		GLuint fragment;
+		try {
+			fragment = compileShader(GL_FRAGMENT_SHADER, injectDefines(fragmentSource, defines));
+		}
+		catch (std::exception&) {
+			glDeleteShader(vertex);
+			glDeleteProgram(shader.program);
+			throw;
+		}
+		glAttachShader(shader.program, vertex);
+		glAttachShader(shader.program, fragment);
+		if (variant & SHADER_FEEDBACK) {
+			const char* varyings[] = { "skinnedPosition", "skinnedNormal", "skinnedUV" };
+			glTransformFeedbackVaryings(shader.program, 3, varyings, GL_INTERLEAVED_ATTRIBS);
+		}
+		if (binaryFormats > 0) {
+			glProgramParameteri(shader.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glLinkProgram(shader.program);
+		glDetachShader(shader.program, vertex);
+		glDetachShader(shader.program, fragment);
+		glDeleteShader(vertex);
+		glDeleteShader(fragment);
+
+		GLint status, length;
+		glGetProgramiv(shader.program, GL_LINK_STATUS, &status);
+		if (status != GL_TRUE) {
+			glGetProgramiv(shader.program, GL_INFO_LOG_LENGTH, &length);
+			std::vector<char> log(length + 1, '\0');
+			glGetProgramInfoLog(shader.program, length, NULL, log.data());
+			glDeleteProgram(shader.program);
+			throw std::runtime_error(std::string("Failed to link program\n") + log.data());
+		}
+		if (binaryFormats > 0) {
+			saveProgramBinary(shader.program, cachePath, key);
+		}
+	}
+
+	GLuint p = shader.program;
+	shader.M = glGetUniformLocation(p, "M");
+	shader.V = glGetUniformLocation(p, "V");
+	shader.P = glGetUniformLocation(p, "P");
+	shader.lightVP = glGetUniformLocation(p, "lightVP");
+	shader.Ka = glGetUniformLocation(p, "mtl.Ka");
+	shader.Kd = glGetUniformLocation(p, "mtl.Kd");
+	shader.Ks = glGetUniformLocation(p, "mtl.Ks");
+	shader.Ns = glGetUniformLocation(p, "mtl.Ns");
+	shader.La = glGetUniformLocation(p, "light.La");
+	shader.Ld = glGetUniformLocation(p, "light.Ld");
+	shader.Ls = glGetUniformLocation(p, "light.Ls");
+	shader.lightPosition = glGetUniformLocation(p, "light.lightPosition_worldspace");
+	shader.lightPower = glGetUniformLocation(p, "light.power");
+	shader.diffuseSampler = glGetUniformLocation(p, "diffuseColorSampler");
+	shader.specularSampler = glGetUniformLocation(p, "specularColorSampler");
+	shader.shadowMapSampler = glGetUniformLocation(p, "shadowMapSampler");
+	shader.planeCoeffs = glGetUniformLocation(p, "planeCoeffs");
+	for (int i = 0; i < MAX_BONES; i++) {
+		std::string name = "boneTransformations[" + std::to_string(i) + "]";
+		shader.boneTransformations[i] = glGetUniformLocation(p, name.c_str());
+	}
+	return shader;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//skinnedmesh.h
+#ifndef SKINNEDMESH_H
+#define SKINNEDMESH_H
+
+#include <GL/glew.h>
+
+/* A mesh skinned once per frame by transform feedback. The skinning stage
+* runs the source vertex array (attributes 0-3) through a feedback program
+* as points and captures the deformed positions, normals and uvs, which
+* every render pass then draws as static geometry.
+*/
+class SkinnedMesh {
+public:
+	/* elementBuffer is shared with the source and not owned */
+	SkinnedMesh(GLuint sourceVAO, GLsizei vertexCount, GLuint elementBuffer);
+	~SkinnedMesh();
+
+	/* Skin the vertices with the bound SHADER_FEEDBACK program, expects
+	* GL_RASTERIZER_DISCARD to be enabled
+	*/
+	void skin();
+
+	/* Bind the skinned vertices (0 position, 1 normal, 2 uv) */
+	void bind();
+
+	GLsizei vertexCount;
+
+private:
+	SkinnedMesh(const SkinnedMesh&);
+	SkinnedMesh& operator=(const SkinnedMesh&);
+
+	GLuint sourceVAO, VAO, feedback, buffer;
+};
+
+#endif
+//end of skinnedmesh.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//skinnedmesh.cpp
+// interleaved position, normal, uv as captured (skinnedPosition, ...)
+#define SKINNED_VERTEX_SIZE (8 * sizeof(GLfloat))
+
+SkinnedMesh::SkinnedMesh(GLuint sourceVAO, GLsizei vertexCount, GLuint elementBuffer) :
+	vertexCount(vertexCount), sourceVAO(sourceVAO) {
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, vertexCount * SKINNED_VERTEX_SIZE, NULL, GL_DYNAMIC_COPY);
+
+	glGenTransformFeedbacks(1, &feedback);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedback);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffer);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+	glGenVertexArrays(1, &VAO);
+	glBindVertexArray(VAO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, SKINNED_VERTEX_SIZE, (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, SKINNED_VERTEX_SIZE,
+		(void*)(3 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, SKINNED_VERTEX_SIZE,
+		(void*)(6 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(2);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
+	glBindVertexArray(0);
+}
+
+SkinnedMesh::~SkinnedMesh() {
+	glDeleteVertexArrays(1, &VAO);
+	glDeleteTransformFeedbacks(1, &feedback);
+	glDeleteBuffers(1, &buffer);
+}
+
+void SkinnedMesh::skin() {
+	glBindVertexArray(sourceVAO);
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedback);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, vertexCount);
+	glEndTransformFeedback();
+	glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+}
+
+void SkinnedMesh::bind() {
+	glBindVertexArray(VAO);
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//offscreen.h
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <glfw3.h>
+#if defined(__linux__)
+// only the surfaceless platform is used, keep X11 out
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+/* A GL 3.3 core context for rendering without a display. On Linux this is a
+* surfaceless EGL context, which Mesa also provides on its software
+* rasterizer (llvmpipe); if that is not available, or elsewhere, GLFW opens
+* a hidden window. Either way there is no default framebuffer to draw to,
+* frames go to an FBO of any size.
+*/
+class OffscreenContext {
+public:
+	/* Creates the context and makes it current, throws if neither works */
+	OffscreenContext();
+	~OffscreenContext();
+
+	/* The hidden window of the GLFW fallback, NULL for EGL. Without a window
+	* GLEW has to be initialized with glewContextInit, glewInit looks for GLX.
+	*/
+	GLFWwindow* window() const { return hiddenWindow; }
+
+private:
+	OffscreenContext(const OffscreenContext&);
+	OffscreenContext& operator=(const OffscreenContext&);
+
+#if defined(__linux__)
+	bool createEGLContext();
+
+	EGLDisplay display;
+	EGLContext context;
+#endif
+	GLFWwindow* hiddenWindow;
+};
+
+#endif
+//end of offscreen.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//offscreen.cpp
+#include <string.h>
+#include <stdexcept>
+
+OffscreenContext::OffscreenContext() : hiddenWindow(NULL) {
+#if defined(__linux__)
+	display = EGL_NO_DISPLAY;
+	context = EGL_NO_CONTEXT;
+	if (createEGLContext()) return;
+#endif
+	if (!glfwInit()) {
+		throw std::runtime_error("Failed to create an offscreen context\n");
+	}
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	hiddenWindow = glfwCreateWindow(64, 64, "offscreen", NULL, NULL);
+	if (hiddenWindow == NULL) {
+		glfwTerminate();
+		throw std::runtime_error("Failed to create an offscreen context\n");
+	}
+	glfwMakeContextCurrent(hiddenWindow);
+}
+
+OffscreenContext::~OffscreenContext() {
+#if defined(__linux__)
+	if (context != EGL_NO_CONTEXT) {
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display, context);
+	}
+	if (display != EGL_NO_DISPLAY) eglTerminate(display);
+#endif
+	if (hiddenWindow != NULL) glfwDestroyWindow(hiddenWindow);
+}
+
+#if defined(__linux__)
+bool OffscreenContext::createEGLContext() {
+	// the surfaceless platform needs no display server, the default display
+	// is tried for drivers without it
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay != NULL) {
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY) return false;
+	if (!eglInitialize(display, NULL, NULL)) {
+		display = EGL_NO_DISPLAY;
+		return false;
+	}
+
+	// no surface at all, everything is drawn to framebuffer objects
+	const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (extensions == NULL || strstr(extensions, "EGL_KHR_surfaceless_context") == NULL ||
+		!eglBindAPI(EGL_OPENGL_API)) {
+		return false;
+	}
+	const EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) ||
+		configCount == 0) {
+		return false;
+	}
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+	if (context == EGL_NO_CONTEXT) return false;
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		eglDestroyContext(display, context);
+		context = EGL_NO_CONTEXT;
+		return false;
+	}
+	return true;
+}
+#endif
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//frameexport.h
+#ifndef FRAMEEXPORT_H
+#define FRAMEEXPORT_H
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* Reads rendered frames back and writes them as a numbered TGA sequence
+* without stalling the renderer. glReadPixels only starts a copy into one of
+* a ring of pixel buffer objects, followed by a fence; a buffer is mapped
+* when the ring comes round to it again, by which time the copy has long
+* finished. Writing the files happens on a background thread, which holds
+* at most maxQueued frames before capture() waits for it.
+*/
+class FrameExporter {
+public:
+	/* Files are prefix00000.tga, prefix00001.tga, ... */
+	FrameExporter(int width, int height, const std::string& prefix,
+		int ringSize = 3, int maxQueued = 8);
+	/* Writes out the frames still in flight */
+	~FrameExporter();
+
+	/* Read back the color buffer of the bound read framebuffer */
+	void capture();
+
+	/* Wait for every captured frame to be written, throws if any failed */
+	void finish();
+
+	unsigned int capturedFrames() const { return frameCount; }
+
+private:
+	FrameExporter(const FrameExporter&);
+	FrameExporter& operator=(const FrameExporter&);
+
+	struct Slot {
+		GLuint pixelBuffer;
+		GLsync fence;  // NULL while the slot is free
+		unsigned int frame;
+	};
+	struct Frame {
+		unsigned int index;
+		std::vector<unsigned char> pixels;
+	};
+
+	void collect(Slot& slot);
+	void writerLoop();
+
+	int width, height;
+	std::string prefix;
+	std::vector<Slot> slots;
+	size_t nextSlot;
+	unsigned int frameCount;
+	size_t maxQueued;
+
+	std::deque<Frame> queue;
+	std::vector<std::vector<unsigned char>> spareBuffers;  // recycled pixel storage
+	unsigned int failedFrames;
+	bool writing, stop;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::thread thread;
+};
+
+#endif
+//end of frameexport.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//frameexport.cpp
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+
+FrameExporter::FrameExporter(int width, int height, const std::string& prefix,
+	int ringSize, int maxQueued) :
+	width(width), height(height), prefix(prefix), slots(ringSize), nextSlot(0),
+	frameCount(0), maxQueued(maxQueued), failedFrames(0), writing(false), stop(false) {
+	size_t frameSize = (size_t)width * height * 4;
+	for (auto& slot : slots) {
+		glGenBuffers(1, &slot.pixelBuffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBuffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+		slot.fence = NULL;
+		slot.frame = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	thread = std::thread(&FrameExporter::writerLoop, this);
+}
+
+FrameExporter::~FrameExporter() {
+	for (size_t i = 0; i < slots.size(); i++) {
+		Slot& slot = slots[(nextSlot + i) % slots.size()];
+		if (slot.fence != NULL) collect(slot);
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+	for (auto& slot : slots) glDeleteBuffers(1, &slot.pixelBuffer);
+}
+
+void FrameExporter::capture() {
+	// the oldest slot is reused, normally its copy finished frames ago
+	Slot& slot = slots[nextSlot];
+	if (slot.fence != NULL) collect(slot);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	// BGRA is the native order of most drivers and of TGA
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.frame = frameCount++;
+	nextSlot = (nextSlot + 1) % slots.size();
+}
+
+void FrameExporter::finish() {
+	// in capture order, the oldest slot is the next one to be reused
+	for (size_t i = 0; i < slots.size(); i++) {
+		Slot& slot = slots[(nextSlot + i) % slots.size()];
+		if (slot.fence != NULL) collect(slot);
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return queue.empty() && !writing; });
+	if (failedFrames > 0) {
+		throw std::runtime_error("Failed to write " + std::to_string(failedFrames) +
+			" frames to " + prefix + "\n");
+	}
+}
+
+void FrameExporter::collect(Slot& slot) {
+	glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(slot.fence);
+	slot.fence = NULL;
+
+	// take a buffer back from the writer, or wait while it is too far behind
+	Frame frame;
+	frame.index = slot.frame;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return queue.size() < maxQueued; });
+		if (!spareBuffers.empty()) {
+			frame.pixels.swap(spareBuffers.back());
+			spareBuffers.pop_back();
+		}
+	}
+	size_t frameSize = (size_t)width * height * 4;
+	frame.pixels.resize(frameSize);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBuffer);
+	void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameSize, GL_MAP_READ_BIT);
+	if (pixels != NULL) {
+		memcpy(frame.pixels.data(), pixels, frameSize);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pixels == NULL) failedFrames++;
+		else queue.push_back(std::move(frame));
+	}
+	wake.notify_one();
+}
+
+void FrameExporter::writerLoop() {
+	// uncompressed 32 bit true color, rows bottom up like glReadPixels
+	unsigned char header[18] = {};
+	header[2] = 2;
+	header[12] = width & 0xff;
+	header[13] = (width >> 8) & 0xff;
+	header[14] = height & 0xff;
+	header[15] = (height >> 8) & 0xff;
+	header[16] = 32;
+	header[17] = 8;  // alpha bits
+
+	char name[16];
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this] { return stop || !queue.empty(); });
+		// flush the queue before stopping
+		if (queue.empty()) return;
+		Frame frame = std::move(queue.front());
+		queue.pop_front();
+		writing = true;
+		lock.unlock();
+
+		// the frame's alpha is whatever the clear and the blending left in it,
+		// the exported frames are opaque
+		for (size_t i = 3; i < frame.pixels.size(); i += 4) frame.pixels[i] = 255;
+
+		snprintf(name, sizeof(name), "%05u.tga", frame.index);
+		std::string path = prefix + name;
+		FILE* file = fopen(path.c_str(), "wb");
+		bool written = file != NULL;
+		if (file != NULL) {
+			written = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+				fwrite(frame.pixels.data(), 1, frame.pixels.size(), file) == frame.pixels.size();
+			written = fclose(file) == 0 && written;
+		}
+
+		lock.lock();
+		if (!written) failedFrames++;
+		spareBuffers.push_back(std::move(frame.pixels));
+		writing = false;
+		done.notify_all();
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//texturecook.h
+#ifndef TEXTURECOOK_H
+#define TEXTURECOOK_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define COOKED_TEXTURE_VERSION 2
+
+/* Layout of a cooked texture: this header, levelCount CookedTextureLevel
+* entries and the block compressed levels, largest first, each at a 16 byte
+* aligned offset. format is the GL internal format the levels are uploaded
+* with as they are. The size and modification time of the source image tell
+* whether it changed since it was cooked.
+*/
+struct CookedTextureHeader {
+	char magic[4];  // "TTEX"
+	uint32_t version;
+	uint32_t format;  // GL_COMPRESSED_RGB_S3TC_DXT1_EXT or ..._RGBA_S3TC_DXT5_EXT
+	uint32_t width, height;
+	uint32_t levelCount;
+	uint64_t sourceSize;
+	int64_t sourceTime;  // seconds since the epoch
+};
+
+struct CookedTextureLevel {
+	uint32_t width, height;
+	uint64_t offset, size;
+};
+
+/* 8 bit RGBA, rows bottom up as GL has them */
+struct TextureImage {
+	int width, height;
+	std::vector<unsigned char> rgba;
+};
+
+class ThreadPool;
+
+/* Halve the image down to 1x1. Each texel of a level is the average of the
+* 2x2 texels under it (edge texels repeat for odd sizes). Colors (srgb) are
+* averaged in linear light so dark and bright detail keep their weight, data
+* maps such as specular intensity as they are stored.
+*/
+void generateMipChain(ThreadPool& pool, const TextureImage& base,
+	std::vector<TextureImage>& levels, bool srgb = true);
+
+/* Compress a 4x4 block of RGBA texels (row by row) to 8 bytes of BC1
+* (DXT1): two RGB565 endpoints along the principal axis of the colors and
+* a 2 bit index per texel.
+*/
+void compressBC1Block(const unsigned char texels[64], unsigned char block[8]);
+
+/* Compress a 4x4 block to 16 bytes of BC3 (DXT5): 3 bit interpolated alpha
+* followed by a BC1 color block.
+*/
+void compressBC3Block(const unsigned char texels[64], unsigned char block[16]);
+
+/* Build the mip chain of the image, block compress every level in parallel
+* and write the container to path, stamped with the source image file it
+* was decoded from. Images with any translucent texel are stored as BC3,
+* the others as BC1. Returns the size of the file.
+*/
+size_t cookTexture(ThreadPool& pool, const TextureImage& image, const std::string& path,
+	const std::string& source, bool srgb = true);
+
+/* Whether the cooked texture at path exists and was cooked from source as it
+* is now. A missing source leaves nothing to compare, the cooked texture is
+* used as it is.
+*/
+bool isCookedTextureCurrent(const std::string& path, const std::string& source);
+
+/* Upload a cooked texture from its memory mapped file, no decoding or
+* conversion, throws if the file is invalid.
+*/
+GLuint loadCookedTexture(const std::string& path);
+
+#endif
+//end of texturecook.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//texturecook.cpp
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <float.h>
+#include <stdexcept>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static const char cookedTextureMagic[4] = { 'T', 'T', 'E', 'X' };
+
+// size and modification time, false if the file cannot be found
+static bool fileStamp(const std::string& path, uint64_t& size, int64_t& time) {
+	struct stat status;
+	if (stat(path.c_str(), &status) != 0) return false;
+	size = (uint64_t)status.st_size;
+	time = (int64_t)status.st_mtime;
+	return true;
+}
+
+static float srgbToLinear(float c) {
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linearToSrgb(float c) {
+	return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+void generateMipChain(ThreadPool& pool, const TextureImage& base,
+	std::vector<TextureImage>& levels, bool srgb) {
+	float toLinear[256];
+	for (int i = 0; i < 256; i++) toLinear[i] = srgb ? srgbToLinear(i / 255.0f) : i / 255.0f;
+
+	levels.assign(1, base);
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const TextureImage& source = levels.back();
+		TextureImage level;
+		level.width = std::max(1, source.width / 2);
+		level.height = std::max(1, source.height / 2);
+		level.rgba.resize((size_t)level.width * level.height * 4);
+		pool.parallelFor(level.height, [&](size_t begin, size_t end, unsigned int) {
+			for (size_t y = begin; y < end; y++) {
+				int y0 = std::min(2 * (int)y, source.height - 1);
+				int y1 = std::min(2 * (int)y + 1, source.height - 1);
+				for (int x = 0; x < level.width; x++) {
+					int x0 = std::min(2 * x, source.width - 1);
+					int x1 = std::min(2 * x + 1, source.width - 1);
+					const unsigned char* texels[4] = {
+						&source.rgba[((size_t)y0 * source.width + x0) * 4],
+						&source.rgba[((size_t)y0 * source.width + x1) * 4],
+						&source.rgba[((size_t)y1 * source.width + x0) * 4],
+						&source.rgba[((size_t)y1 * source.width + x1) * 4]
+					};
+					unsigned char* out = &level.rgba[((size_t)y * level.width + x) * 4];
+					for (int c = 0; c < 3; c++) {
+						float sum = 0.0f;
+						for (int k = 0; k < 4; k++) sum += toLinear[texels[k][c]];
+						float average = sum * 0.25f;
+						out[c] = (unsigned char)((srgb ? linearToSrgb(average) : average) * 255.0f + 0.5f);
+					}
+					int alpha = texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3];
+					out[3] = (unsigned char)((alpha + 2) / 4);
+				}
+			}
+		});
+		levels.push_back(std::move(level));
+	}
+}
+
+static uint16_t packRGB565(const float color[3]) {
+	int r = (int)(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+	int g = (int)(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+	int b = (int)(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(uint16_t packed, int color[3]) {
+	int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+void compressBC1Block(const unsigned char texels[64], unsigned char block[8]) {
+	// principal axis of the colors by power iteration on their covariance
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) mean[c] += texels[4 * i + c] / 16.0f;
+	}
+	float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };  // rr rg rb gg gb bb
+	for (int i = 0; i < 16; i++) {
+		float d[3] = { texels[4 * i] - mean[0], texels[4 * i + 1] - mean[1],
+			texels[4 * i + 2] - mean[2] };
+		covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1];
+		covariance[2] += d[0] * d[2]; covariance[3] += d[1] * d[1];
+		covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+	}
+	// starting from the channel that varies most
+	int channel = covariance[0] >= covariance[3] ? (covariance[0] >= covariance[5] ? 0 : 2) :
+		(covariance[3] >= covariance[5] ? 1 : 2);
+	float axis[3] = { channel == 0 ? 1.0f : 0.0f, channel == 1 ? 1.0f : 0.0f,
+		channel == 2 ? 1.0f : 0.0f };
+	for (int iteration = 0; iteration < 8; iteration++) {
+		float next[3] = {
+			covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+			covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+			covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+		};
+		float length = std::max(fabsf(next[0]), std::max(fabsf(next[1]), fabsf(next[2])));
+		if (length < FLT_EPSILON) break;
+		for (int c = 0; c < 3; c++) axis[c] = next[c] / length;
+	}
+
+	// extremes along the axis, inset a little as the ends are rarely hit
+	float minProjection = FLT_MAX, maxProjection = -FLT_MAX;
+	for (int i = 0; i < 16; i++) {
+		float p = 0.0f;
+		for (int c = 0; c < 3; c++) p += (texels[4 * i + c] - mean[c]) * axis[c];
+		minProjection = std::min(minProjection, p);
+		maxProjection = std::max(maxProjection, p);
+	}
+	float axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float inset = (maxProjection - minProjection) / 16.0f;
+	float high[3], low[3];
+	for (int c = 0; c < 3; c++) {
+		high[c] = mean[c] + axis[c] * (maxProjection - inset) / axisLength;
+		low[c] = mean[c] + axis[c] * (minProjection + inset) / axisLength;
+	}
+	uint16_t color0 = packRGB565(high), color1 = packRGB565(low);
+	// color0 > color1 selects the four color mode
+	if (color0 < color1) std::swap(color0, color1);
+
+	int palette[4][3];
+	unpackRGB565(color0, palette[0]);
+	unpackRGB565(color1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	uint32_t indices = 0;
+	if (color0 != color1) {
+		for (int i = 0; i < 16; i++) {
+			int best = 0, bestError = INT32_MAX;
+			for (int k = 0; k < 4; k++) {
+				int error = 0;
+				for (int c = 0; c < 3; c++) {
+					int d = texels[4 * i + c] - palette[k][c];
+					error += d * d;
+				}
+				if (error < bestError) { best = k; bestError = error; }
+			}
+			indices |= (uint32_t)best << (2 * i);
+		}
+	}
+	block[0] = color0 & 0xff; block[1] = color0 >> 8;
+	block[2] = color1 & 0xff; block[3] = color1 >> 8;
+	for (int i = 0; i < 4; i++) block[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// alpha palette of a BC3 block, eight interpolated values if a0 > a1,
+// otherwise six plus 0 and 255
+static void alphaPalette(int a0, int a1, int palette[8]) {
+	palette[0] = a0;
+	palette[1] = a1;
+	if (a0 > a1) {
+		for (int k = 1; k < 7; k++) palette[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+	}
+	else {
+		for (int k = 1; k < 5; k++) palette[k + 1] = ((5 - k) * a0 + k * a1) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+}
+
+static int encodeAlpha(const unsigned char texels[64], int a0, int a1, uint64_t& indices) {
+	int palette[8];
+	alphaPalette(a0, a1, palette);
+	int totalError = 0;
+	indices = 0;
+	for (int i = 0; i < 16; i++) {
+		int best = 0, bestError = INT32_MAX;
+		for (int k = 0; k < 8; k++) {
+			int d = texels[4 * i + 3] - palette[k];
+			if (d * d < bestError) { best = k; bestError = d * d; }
+		}
+		totalError += bestError;
+		indices |= (uint64_t)best << (3 * i);
+	}
+	return totalError;
+}
+
+void compressBC3Block(const unsigned char texels[64], unsigned char block[16]) {
+	// the full range, or the range of the texels that are neither fully
+	// transparent nor opaque with 0 and 255 exact, whichever fits better
+	int minAlpha = 255, maxAlpha = 0, minInner = 255, maxInner = 0;
+	for (int i = 0; i < 16; i++) {
+		int a = texels[4 * i + 3];
+		minAlpha = std::min(minAlpha, a);
+		maxAlpha = std::max(maxAlpha, a);
+		if (a != 0 && a != 255) {
+			minInner = std::min(minInner, a);
+			maxInner = std::max(maxInner, a);
+		}
+	}
+	int a0 = maxAlpha, a1 = minAlpha;
+	uint64_t indices;
+	int error = encodeAlpha(texels, a0, a1, indices);
+	if (error > 0) {
+		if (minInner > maxInner) minInner = maxInner = 0;
+		uint64_t innerIndices;
+		if (encodeAlpha(texels, minInner, maxInner, innerIndices) < error) {
+			a0 = minInner;
+			a1 = maxInner;
+			indices = innerIndices;
+		}
+	}
+	block[0] = (unsigned char)a0;
+	block[1] = (unsigned char)a1;
+	for (int i = 0; i < 6; i++) block[2 + i] = (indices >> (8 * i)) & 0xff;
+	compressBC1Block(texels, block + 8);
+}
+
+size_t cookTexture(ThreadPool& pool, const TextureImage& image, const std::string& path,
+	const std::string& source, bool srgb) {
+	bool translucent = false;
+	for (size_t i = 3; i < image.rgba.size(); i += 4) translucent |= image.rgba[i] != 255;
+	size_t blockSize = translucent ? 16 : 8;
+
+	std::vector<TextureImage> levels;
+	generateMipChain(pool, image, levels, srgb);
+
+	CookedTextureHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cookedTextureMagic, 4);
+	header.version = COOKED_TEXTURE_VERSION;
+	header.format = translucent ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT :
+		GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	header.width = image.width;
+	header.height = image.height;
+	header.levelCount = (uint32_t)levels.size();
+	if (!fileStamp(source, header.sourceSize, header.sourceTime)) {
+		throw std::runtime_error("Failed to read " + source + "\n");
+	}
+
+	// every block of every level is one job, written straight to its place
+	std::vector<CookedTextureLevel> entries(levels.size());
+	std::vector<size_t> firstBlock(levels.size() + 1, 0);
+	uint64_t offset = sizeof(header) + entries.size() * sizeof(CookedTextureLevel);
+	for (size_t l = 0; l < levels.size(); l++) {
+		size_t blocksX = (levels[l].width + 3) / 4, blocksY = (levels[l].height + 3) / 4;
+		offset = (offset + 15) & ~(uint64_t)15;
+		entries[l].width = levels[l].width;
+		entries[l].height = levels[l].height;
+		entries[l].offset = offset;
+		entries[l].size = blocksX * blocksY * blockSize;
+		offset += entries[l].size;
+		firstBlock[l + 1] = firstBlock[l] + blocksX * blocksY;
+	}
+	std::vector<unsigned char> blob((size_t)offset, 0);
+	memcpy(blob.data(), &header, sizeof(header));
+	memcpy(blob.data() + sizeof(header), entries.data(), entries.size() * sizeof(CookedTextureLevel));
+
+	pool.parallelFor(firstBlock.back(), [&](size_t begin, size_t end, unsigned int) {
+		size_t l = std::upper_bound(firstBlock.begin(), firstBlock.end(), begin) -
+			firstBlock.begin() - 1;
+		unsigned char texels[64];
+		for (size_t b = begin; b < end; b++) {
+			while (b >= firstBlock[l + 1]) l++;
+			const TextureImage& level = levels[l];
+			size_t blocksX = (level.width + 3) / 4, index = b - firstBlock[l];
+			int bx = (int)(index % blocksX) * 4, by = (int)(index / blocksX) * 4;
+			// levels smaller than a block repeat their edge
+			for (int y = 0; y < 4; y++) {
+				for (int x = 0; x < 4; x++) {
+					int sx = std::min(bx + x, level.width - 1), sy = std::min(by + y, level.height - 1);
+					memcpy(&texels[(y * 4 + x) * 4], &level.rgba[((size_t)sy * level.width + sx) * 4], 4);
+				}
+			}
+			unsigned char* block = blob.data() + entries[l].offset + index * blockSize;
+			if (translucent) compressBC3Block(texels, block);
+			else compressBC1Block(texels, block);
+		}
+	});
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) {
+		throw std::runtime_error("Failed to open " + path + "\n");
+	}
+	bool written = fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+	if (fclose(file) != 0 || !written) {
+		throw std::runtime_error("Failed to write " + path + "\n");
+	}
+	return blob.size();
+}
+
+bool isCookedTextureCurrent(const std::string& path, const std::string& source) {
+	CookedTextureHeader header;
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL) return false;
+	bool read = fread(&header, sizeof(header), 1, file) == 1;
+	fclose(file);
+	if (!read || memcmp(header.magic, cookedTextureMagic, 4) != 0 ||
+		header.version != COOKED_TEXTURE_VERSION) {
+		return false;
+	}
+	uint64_t size;
+	int64_t time;
+	if (!fileStamp(source, size, time)) return true;
+	return size == header.sourceSize && time == header.sourceTime;
+}
+
+GLuint loadCookedTexture(const std::string& path) {
+	MappedFile file;
+	file.open(path);
+	CookedTextureHeader header;
+	if (file.size() < sizeof(header)) {
+		throw std::runtime_error("Invalid cooked texture " + path + "\n");
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, cookedTextureMagic, 4) != 0 ||
+		header.version != COOKED_TEXTURE_VERSION || header.levelCount == 0 ||
+		(header.format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT &&
+			header.format != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) ||
+		header.levelCount > (file.size() - sizeof(header)) / sizeof(CookedTextureLevel)) {
+		throw std::runtime_error("Invalid cooked texture " + path + "\n");
+	}
+	uint64_t blockSize = header.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+	std::vector<CookedTextureLevel> levels(header.levelCount);
+	memcpy(levels.data(), file.data() + sizeof(header), levels.size() * sizeof(CookedTextureLevel));
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	for (GLint l = 0; l < (GLint)levels.size(); l++) {
+		// the level must lie in the file and hold exactly its 4x4 blocks
+		const CookedTextureLevel& level = levels[l];
+		if (level.size != ((uint64_t)level.width + 3) / 4 * (((uint64_t)level.height + 3) / 4) * blockSize) {
+			glDeleteTextures(1, &texture);
+			throw std::runtime_error("Invalid cooked texture " + path + "\n");
+		}
+		if (level.offset > file.size() || level.size > file.size() - level.offset) {
+			glDeleteTextures(1, &texture);
+			throw std::runtime_error("Truncated cooked texture " + path + "\n");
+		}
+		glCompressedTexImage2D(GL_TEXTURE_2D, l, header.format, level.width,
+			level.height, 0, (GLsizei)level.size, file.data() + level.offset);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size() - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	return texture;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//picking.h
+#ifndef PICKING_H
+#define PICKING_H
+
+#include <vector>
+#include <float.h>
+#include <glm/glm.hpp>
+
+/* Result of a query against the deformed tree */
+struct PickHit {
+	int bone;  // -1 if nothing was found
+	float distance;  // ray parameter, or distance to the query point
+	glm::vec3 point;  // model space, current pose
+	glm::vec3 localPoint;  // the same point at the binding pose, it moves with the bone
+};
+
+/* Bounding volume hierarchy over the bone capsules and small clusters of
+* trunk triangles. It is built once at the binding pose; every frame only
+* the leaves are moved with their bones and the node bounds are refit
+* bottom up, the topology is kept. Triangle vertices are skinned with their
+* own bone, and only for the clusters a query reaches.
+*/
+class PickingBVH {
+public:
+	/* vertexBones has the bone of each vertex, indices three per triangle */
+	void build(const std::vector<Capsule>& capsules, const std::vector<glm::vec3>& vertices,
+		const std::vector<float>& vertexBones, const std::vector<unsigned int>& indices,
+		unsigned int clusterSize = 32);
+
+	/* Move the primitives to the pose, skinning[bone] is the world
+	* transformation of the bone times its inverse binding transformation
+	*/
+	void refit(const std::vector<RigidTransform>& skinning);
+
+	/* First hit along origin + t * direction for t in [0, maxDistance], the
+	* direction need not be normalized (distance is t)
+	*/
+	PickHit rayCast(const glm::vec3& origin, const glm::vec3& direction,
+		float maxDistance = FLT_MAX) const;
+
+	/* Closest point of the surface within maxDistance */
+	PickHit closestPoint(const glm::vec3& point, float maxDistance = FLT_MAX) const;
+
+private:
+	struct Primitive {
+		int capsule;  // index into capsules, -1 for a triangle cluster
+		unsigned int firstTriangle, triangleCount;
+		unsigned int firstPart, partCount;
+		AABB bounds;  // at the current pose
+	};
+	// bounds at the binding pose of the vertices of a cluster moved by one bone
+	struct ClusterPart {
+		int bone;
+		AABB bindBounds;
+	};
+	struct Node {
+		AABB bounds;
+		int left, right;  // children, or -1 and the primitive for a leaf
+	};
+
+	int buildNode(std::vector<unsigned int>& order, size_t begin, size_t end);
+	void intersectPrimitive(const Primitive& primitive, const glm::vec3& origin,
+		const glm::vec3& direction, PickHit& hit) const;
+	void closestOnPrimitive(const Primitive& primitive, const glm::vec3& point, PickHit& hit) const;
+
+	std::vector<Capsule> capsules;
+	std::vector<glm::vec3> vertices;
+	std::vector<int> vertexBones;
+	std::vector<unsigned int> triangles;  // three indices each, grouped by cluster
+	std::vector<ClusterPart> parts;
+	std::vector<Primitive> primitives;
+	std::vector<Node> nodes;  // parents before children, nodes[0] is the root
+	std::vector<RigidTransform> skinning;
+};
+
+#endif
+//end of picking.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//picking.cpp
+#include <algorithm>
+#include <utility>
+
+// median splits of order[begin, end) on the longest axis of the centroids
+// down to ranges of at most clusterSize
+static void splitTriangles(std::vector<unsigned int>& order, size_t begin, size_t end,
+	const std::vector<glm::vec3>& centroids, unsigned int clusterSize,
+	std::vector<std::pair<size_t, size_t> >& clusters) {
+	if (end - begin <= clusterSize) {
+		clusters.push_back(std::make_pair(begin, end));
+		return;
+	}
+	AABB bounds{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+	for (size_t i = begin; i < end; i++) bounds.expand(centroids[order[i]]);
+	glm::vec3 extent = bounds.max - bounds.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	size_t middle = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+		[&](unsigned int a, unsigned int b) { return centroids[a][axis] < centroids[b][axis]; });
+	splitTriangles(order, begin, middle, centroids, clusterSize, clusters);
+	splitTriangles(order, middle, end, centroids, clusterSize, clusters);
+}
+
+void PickingBVH::build(const std::vector<Capsule>& capsules,
+	const std::vector<glm::vec3>& vertices, const std::vector<float>& vertexBones,
+	const std::vector<unsigned int>& indices, unsigned int clusterSize) {
+	this->capsules = capsules;
+	this->vertices = vertices;
+	this->vertexBones.assign(vertexBones.begin(), vertexBones.end());
+	int boneCount = 0;
+	for (int bone : this->vertexBones) boneCount = std::max(boneCount, bone + 1);
+	for (const Capsule& capsule : capsules) boneCount = std::max(boneCount, capsule.bone + 1);
+	skinning.assign(boneCount, RigidTransform());
+	primitives.clear();
+	parts.clear();
+	triangles.clear();
+
+	for (unsigned int i = 0; i < capsules.size(); i++) {
+		Primitive primitive = {};
+		primitive.capsule = i;
+		primitives.push_back(primitive);
+	}
+
+	// clusters of triangles close together: by the bone of their first
+	// vertex, then split at the median of the longest axis until small enough
+	size_t triangleCount = indices.size() / 3;
+	std::vector<glm::vec3> centroids(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++) {
+		centroids[t] = (vertices[indices[3 * t]] + vertices[indices[3 * t + 1]] +
+			vertices[indices[3 * t + 2]]) / 3.0f;
+	}
+	std::vector<unsigned int> order(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++) order[t] = (unsigned int)t;
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return this->vertexBones[indices[3 * a]] < this->vertexBones[indices[3 * b]];
+	});
+	std::vector<std::pair<size_t, size_t> > clusters;
+	for (size_t begin = 0; begin < triangleCount;) {
+		size_t end = begin;
+		while (end < triangleCount && this->vertexBones[indices[3 * order[end]]] ==
+			this->vertexBones[indices[3 * order[begin]]]) {
+			end++;
+		}
+		splitTriangles(order, begin, end, centroids, clusterSize, clusters);
+		begin = end;
+	}
+	for (const auto& cluster : clusters) {
+		size_t begin = cluster.first, end = cluster.second;
+		Primitive primitive = {};
+		primitive.capsule = -1;
+		primitive.firstTriangle = (unsigned int)(triangles.size() / 3);
+		primitive.triangleCount = (unsigned int)(end - begin);
+		primitive.firstPart = (unsigned int)parts.size();
+		for (size_t t = begin; t < end; t++) {
+			for (int k = 0; k < 3; k++) {
+				unsigned int v = indices[3 * order[t] + k];
+				triangles.push_back(v);
+				// vertices shared with a neighbouring bone get a part of their own
+				ClusterPart* part = NULL;
+				for (unsigned int p = primitive.firstPart; p < parts.size(); p++) {
+					if (parts[p].bone == this->vertexBones[v]) part = &parts[p];
+				}
+				if (part == NULL) {
+					parts.push_back(ClusterPart{ this->vertexBones[v],
+						AABB{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) } });
+					part = &parts.back();
+				}
+				part->bindBounds.expand(vertices[v]);
+			}
+		}
+		primitive.partCount = (unsigned int)parts.size() - primitive.firstPart;
+		primitives.push_back(primitive);
+	}
+
+	// the topology comes from the binding pose
+	refit(skinning);
+	std::vector<unsigned int> primitiveOrder(primitives.size());
+	for (size_t i = 0; i < primitives.size(); i++) primitiveOrder[i] = (unsigned int)i;
+	nodes.clear();
+	if (!primitives.empty()) buildNode(primitiveOrder, 0, primitiveOrder.size());
+	refit(skinning);
+}
+
+int PickingBVH::buildNode(std::vector<unsigned int>& order, size_t begin, size_t end) {
+	int index = (int)nodes.size();
+	nodes.push_back(Node());
+	if (end - begin == 1) {
+		nodes[index].left = -1;
+		nodes[index].right = order[begin];
+		return index;
+	}
+	// median split on the longest axis of the centroids
+	AABB centers{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+	for (size_t i = begin; i < end; i++) {
+		const AABB& box = primitives[order[i]].bounds;
+		centers.expand((box.min + box.max) * 0.5f);
+	}
+	glm::vec3 extent = centers.max - centers.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	size_t middle = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+		[&](unsigned int a, unsigned int b) {
+		return primitives[a].bounds.min[axis] + primitives[a].bounds.max[axis] <
+			primitives[b].bounds.min[axis] + primitives[b].bounds.max[axis];
+	});
+	int left = buildNode(order, begin, middle);
+	int right = buildNode(order, middle, end);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+void PickingBVH::refit(const std::vector<RigidTransform>& skinning) {
+	for (size_t bone = 0; bone < this->skinning.size() && bone < skinning.size(); bone++) {
+		this->skinning[bone] = skinning[bone];
+	}
+	std::vector<glm::mat4> boneMatrices(this->skinning.size());
+	for (size_t bone = 0; bone < boneMatrices.size(); bone++) {
+		boneMatrices[bone] = this->skinning[bone].toMat4();
+	}
+
+	for (Primitive& primitive : primitives) {
+		if (primitive.capsule >= 0) {
+			const Capsule& capsule = capsules[primitive.capsule];
+			const RigidTransform& T = this->skinning[capsule.bone];
+			glm::vec3 a = T.transformPoint(capsule.a), b = T.transformPoint(capsule.b);
+			primitive.bounds.min = glm::min(a, b) - glm::vec3(capsule.radius);
+			primitive.bounds.max = glm::max(a, b) + glm::vec3(capsule.radius);
+			continue;
+		}
+		primitive.bounds = AABB{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+		for (unsigned int p = primitive.firstPart; p < primitive.firstPart + primitive.partCount; p++) {
+			primitive.bounds.expand(transformAABB(parts[p].bindBounds, boneMatrices[parts[p].bone]));
+		}
+	}
+
+	// children come after their parents
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		Node& node = nodes[i];
+		if (node.left < 0) {
+			node.bounds = primitives[node.right].bounds;
+		}
+		else {
+			node.bounds = nodes[node.left].bounds;
+			node.bounds.expand(nodes[node.right].bounds);
+		}
+	}
+}
+
+// entry parameter of the ray into the box, or FLT_MAX if it misses
+static float intersectAABB(const AABB& box, const glm::vec3& origin,
+	const glm::vec3& inverseDirection, float maxDistance) {
+	glm::vec3 t0 = (box.min - origin) * inverseDirection, t1 = (box.max - origin) * inverseDirection;
+	glm::vec3 entries = glm::min(t0, t1), exits = glm::max(t0, t1);
+	float enter = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+	float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, maxDistance));
+	return enter <= exit ? enter : FLT_MAX;
+}
+
+// closest point of segment a-b to p
+static glm::vec3 closestOnSegment(const glm::vec3& a, const glm::vec3& b, const glm::vec3& p) {
+	glm::vec3 ab = b - a;
+	float length2 = glm::dot(ab, ab);
+	float s = length2 > 0.0f ? glm::clamp(glm::dot(p - a, ab) / length2, 0.0f, 1.0f) : 0.0f;
+	return a + ab * s;
+}
+
+// ray against the capsule a-b, the smallest t >= 0 or -1
+static float intersectCapsule(const glm::vec3& a, const glm::vec3& b, float radius,
+	const glm::vec3& origin, const glm::vec3& direction) {
+	glm::vec3 ab = b - a, ao = origin - a;
+	float abab = glm::dot(ab, ab), abd = glm::dot(ab, direction), abao = glm::dot(ab, ao);
+	float dd = glm::dot(direction, direction), dao = glm::dot(direction, ao), aoao = glm::dot(ao, ao);
+	// the infinite cylinder first, then the end caps
+	float qa = abab * dd - abd * abd;
+	float qb = abab * dao - abao * abd;
+	float qc = abab * aoao - abao * abao - radius * radius * abab;
+	float best = -1.0f;
+	if (qa > 0.0f) {
+		float discriminant = qb * qb - qa * qc;
+		if (discriminant >= 0.0f) {
+			float t = (-qb - sqrtf(discriminant)) / qa;
+			float s = abao + t * abd;
+			if (t >= 0.0f && s > 0.0f && s < abab) best = t;
+		}
+	}
+	for (int cap = 0; cap < 2; cap++) {
+		glm::vec3 oc = origin - (cap == 0 ? a : b);
+		float c = glm::dot(oc, oc) - radius * radius;
+		float half = glm::dot(oc, direction);
+		float discriminant = half * half - dd * c;
+		if (dd <= 0.0f || discriminant < 0.0f) continue;
+		float t = (-half - sqrtf(discriminant)) / dd;
+		if (t >= 0.0f && (best < 0.0f || t < best)) best = t;
+	}
+	return best;
+}
+
+// closest point of triangle abc to p as barycentric weights (Ericson)
+static glm::vec3 closestOnTriangle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c,
+	const glm::vec3& p) {
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return glm::vec3(1, 0, 0);
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return glm::vec3(0, 1, 0);
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		float v = d1 / (d1 - d3);
+		return glm::vec3(1.0f - v, v, 0.0f);
+	}
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return glm::vec3(0, 0, 1);
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		float w = d2 / (d2 - d6);
+		return glm::vec3(1.0f - w, 0.0f, w);
+	}
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+		float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		return glm::vec3(0.0f, 1.0f - w, w);
+	}
+	float denominator = 1.0f / (va + vb + vc);
+	float v = vb * denominator, w = vc * denominator;
+	return glm::vec3(1.0f - v - w, v, w);
+}
+
+void PickingBVH::intersectPrimitive(const Primitive& primitive, const glm::vec3& origin,
+	const glm::vec3& direction, PickHit& hit) const {
+	if (primitive.capsule >= 0) {
+		const Capsule& capsule = capsules[primitive.capsule];
+		const RigidTransform& T = skinning[capsule.bone];
+		float t = intersectCapsule(T.transformPoint(capsule.a), T.transformPoint(capsule.b),
+			capsule.radius, origin, direction);
+		if (t >= 0.0f && t < hit.distance) {
+			hit.bone = capsule.bone;
+			hit.distance = t;
+			hit.point = origin + direction * t;
+			hit.localPoint = T.inverse().transformPoint(hit.point);
+		}
+		return;
+	}
+	for (unsigned int i = primitive.firstTriangle; i < primitive.firstTriangle + primitive.triangleCount; i++) {
+		const unsigned int* v = &triangles[3 * i];
+		glm::vec3 p[3];
+		for (int k = 0; k < 3; k++) p[k] = skinning[vertexBones[v[k]]].transformPoint(vertices[v[k]]);
+		// Moller-Trumbore
+		glm::vec3 e1 = p[1] - p[0], e2 = p[2] - p[0];
+		glm::vec3 h = glm::cross(direction, e2);
+		float determinant = glm::dot(e1, h);
+		if (fabsf(determinant) < 1e-12f) continue;
+		float f = 1.0f / determinant;
+		glm::vec3 s = origin - p[0];
+		float u = f * glm::dot(s, h);
+		if (u < 0.0f || u > 1.0f) continue;
+		glm::vec3 q = glm::cross(s, e1);
+		float w = f * glm::dot(direction, q);
+		if (w < 0.0f || u + w > 1.0f) continue;
+		float t = f * glm::dot(e2, q);
+		if (t < 0.0f || t >= hit.distance) continue;
+		glm::vec3 weights(1.0f - u - w, u, w);
+		int strongest = weights.x >= weights.y ? (weights.x >= weights.z ? 0 : 2) : (weights.y >= weights.z ? 1 : 2);
+		hit.bone = vertexBones[v[strongest]];
+		hit.distance = t;
+		hit.point = origin + direction * t;
+		hit.localPoint = vertices[v[0]] * weights.x + vertices[v[1]] * weights.y + vertices[v[2]] * weights.z;
+	}
+}
+
+void PickingBVH::closestOnPrimitive(const Primitive& primitive, const glm::vec3& point,
+	PickHit& hit) const {
+	if (primitive.capsule >= 0) {
+		const Capsule& capsule = capsules[primitive.capsule];
+		const RigidTransform& T = skinning[capsule.bone];
+		glm::vec3 axisPoint = closestOnSegment(T.transformPoint(capsule.a), T.transformPoint(capsule.b), point);
+		glm::vec3 offset = point - axisPoint;
+		float length = glm::length(offset);
+		// inside the capsule the query point is its own closest point
+		float distance = std::max(length - capsule.radius, 0.0f);
+		if (distance < hit.distance) {
+			hit.bone = capsule.bone;
+			hit.distance = distance;
+			hit.point = length > capsule.radius ? axisPoint + offset * (capsule.radius / length) : point;
+			hit.localPoint = T.inverse().transformPoint(hit.point);
+		}
+		return;
+	}
+	for (unsigned int i = primitive.firstTriangle; i < primitive.firstTriangle + primitive.triangleCount; i++) {
+		const unsigned int* v = &triangles[3 * i];
+		glm::vec3 p[3];
+		for (int k = 0; k < 3; k++) p[k] = skinning[vertexBones[v[k]]].transformPoint(vertices[v[k]]);
+		glm::vec3 weights = closestOnTriangle(p[0], p[1], p[2], point);
+		glm::vec3 closest = p[0] * weights.x + p[1] * weights.y + p[2] * weights.z;
+		float distance = glm::length(point - closest);
+		if (distance >= hit.distance) continue;
+		int strongest = weights.x >= weights.y ? (weights.x >= weights.z ? 0 : 2) : (weights.y >= weights.z ? 1 : 2);
+		hit.bone = vertexBones[v[strongest]];
+		hit.distance = distance;
+		hit.point = closest;
+		hit.localPoint = vertices[v[0]] * weights.x + vertices[v[1]] * weights.y + vertices[v[2]] * weights.z;
+	}
+}
+
+PickHit PickingBVH::rayCast(const glm::vec3& origin, const glm::vec3& direction,
+	float maxDistance) const {
+	PickHit hit;
+	hit.bone = -1;
+	hit.distance = maxDistance;
+	if (nodes.empty()) return hit;
+	glm::vec3 inverseDirection = 1.0f / direction;
+
+	// nearer child first, boxes behind the best hit are skipped
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node& node = nodes[stack[--top]];
+		if (intersectAABB(node.bounds, origin, inverseDirection, hit.distance) == FLT_MAX) continue;
+		if (node.left < 0) {
+			intersectPrimitive(primitives[node.right], origin, direction, hit);
+			continue;
+		}
+		float left = intersectAABB(nodes[node.left].bounds, origin, inverseDirection, hit.distance);
+		float right = intersectAABB(nodes[node.right].bounds, origin, inverseDirection, hit.distance);
+		if (left <= right) {
+			if (right != FLT_MAX) stack[top++] = node.right;
+			if (left != FLT_MAX) stack[top++] = node.left;
+		}
+		else {
+			if (left != FLT_MAX) stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+	}
+	if (hit.bone < 0) hit.distance = FLT_MAX;
+	return hit;
+}
+
+// distance from p to the box, 0 inside
+static float distanceToAABB(const AABB& box, const glm::vec3& p) {
+	glm::vec3 d = glm::max(glm::max(box.min - p, p - box.max), glm::vec3(0.0f));
+	return glm::length(d);
+}
+
+PickHit PickingBVH::closestPoint(const glm::vec3& point, float maxDistance) const {
+	PickHit hit;
+	hit.bone = -1;
+	hit.distance = maxDistance;
+	if (nodes.empty()) return hit;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node& node = nodes[stack[--top]];
+		if (distanceToAABB(node.bounds, point) >= hit.distance) continue;
+		if (node.left < 0) {
+			closestOnPrimitive(primitives[node.right], point, hit);
+			continue;
+		}
+		float left = distanceToAABB(nodes[node.left].bounds, point);
+		float right = distanceToAABB(nodes[node.right].bounds, point);
+		if (left <= right) {
+			stack[top++] = node.right;
+			stack[top++] = node.left;
+		}
+		else {
+			stack[top++] = node.left;
+			stack[top++] = node.right;
+		}
+	}
+	if (hit.bone < 0) hit.distance = FLT_MAX;
+	return hit;
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//forest.h
+#ifndef FOREST_H
+#define FOREST_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <glm/glm.hpp>
+
+#define FOREST_VERSION 1
+
+/* Layout of a forest file (little endian):
+*   ForestHeader
+*   tiles: a ForestTileEntry per tile, row after row of tilesX tiles
+*   instances: ForestInstance records grouped by tile
+* The ground is cut into square tiles of tileSize from (originX, originZ) on
+* the xz plane, an instance belongs to the tile its translation falls in.
+*/
+struct ForestHeader {
+	char magic[4];  // "TFST"
+	uint32_t version;
+	uint32_t tilesX, tilesZ;
+	float tileSize;
+	float originX, originZ;
+	uint32_t speciesCount;  // every species id is below this
+	uint64_t instanceCount;
+};
+
+struct ForestTileEntry {
+	uint64_t firstInstance;
+	uint32_t instanceCount;
+	uint32_t reserved;
+};
+
+/* A placed tree, 64 bytes */
+struct ForestInstance {
+	uint32_t species;
+	float transform[12];  // model matrix without its last row, column after column
+	uint32_t reserved;
+	uint64_t seed;  // of its simulation
+
+	glm::mat4 modelMatrix() const;
+	void setModelMatrix(const glm::mat4& m);
+};
+
+/* Bin the instances into tiles of tileSize covering all of them and write
+* the file, throws if it cannot be written
+*/
+void writeForest(const std::string& path, float tileSize, uint32_t speciesCount,
+	const std::vector<ForestInstance>& instances);
+
+/* The instances of a tile, copied out of the file */
+struct ForestTile {
+	int x, z;
+	std::vector<ForestInstance> instances;
+};
+
+/* Pages the tiles of a forest file in and out around a moving point. The
+* file is memory mapped and a loader thread copies out the tiles within
+* radius tiles of the point, nearest first, so the page faults never land on
+* the caller. Tiles further than radius + 1 away are retired and their pages
+* released; the one tile of hysteresis keeps a point moving along a tile edge
+* from loading the same tiles over and over. At most (2 * radius + 3)^2 tiles
+* are resident, whatever the size of the forest.
+*/
+class ForestStreamer {
+public:
+	/* Map and validate the file, throws on a malformed one */
+	ForestStreamer(const std::string& path, int radius);
+	~ForestStreamer();
+
+	/* Move the streamed area to position, once per frame. Tiles loaded since
+	* the last call are appended to loaded and belong to the caller from then
+	* on, the tiles handed out before that the caller should now drop are
+	* appended to retired.
+	*/
+	void update(const glm::vec3& position, std::vector<ForestTile*>& loaded,
+		std::vector<std::pair<int, int>>& retired);
+
+	const ForestHeader& header() const { return fileHeader; }
+
+private:
+	ForestStreamer(const ForestStreamer&);
+	ForestStreamer& operator=(const ForestStreamer&);
+
+	typedef std::pair<int, int> TileCoordinates;
+
+	void loaderLoop();
+	const ForestTileEntry& tileEntry(const TileCoordinates& tile) const {
+		return tiles[tile.second * fileHeader.tilesX + tile.first];
+	}
+
+	MappedFile file;
+	ForestHeader fileHeader;
+	const ForestTileEntry* tiles;
+	int radius;
+	std::set<TileCoordinates> delivered;  // handed to the caller
+
+	std::set<TileCoordinates> wanted;  // requested, loading or delivered
+	std::deque<TileCoordinates> requests;
+	std::vector<ForestTile*> finished;
+	bool stop;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::thread thread;
+};
+
+#endif
+//end of forest.h
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//forest.cpp
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <float.h>
+#include <limits.h>
+#include <algorithm>
+#include <stdexcept>
+
+static const char forestMagic[4] = { 'T', 'F', 'S', 'T' };
+
+glm::mat4 ForestInstance::modelMatrix() const {
+	glm::mat4 m;
+	for (int c = 0; c < 4; c++) {
+		m[c] = glm::vec4(transform[3 * c], transform[3 * c + 1], transform[3 * c + 2],
+			c == 3 ? 1.0f : 0.0f);
+	}
+	return m;
+}
+
+void ForestInstance::setModelMatrix(const glm::mat4& m) {
+	for (int c = 0; c < 4; c++) {
+		for (int r = 0; r < 3; r++) transform[3 * c + r] = m[c][r];
+	}
+}
+
+void writeForest(const std::string& path, float tileSize, uint32_t speciesCount,
+	const std::vector<ForestInstance>& instances) {
+	if (tileSize <= 0.0f) {
+		throw std::runtime_error("Forest tiles need a positive size\n");
+	}
+	ForestHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, forestMagic, 4);
+	header.version = FOREST_VERSION;
+	header.tileSize = tileSize;
+	header.speciesCount = speciesCount;
+	header.instanceCount = instances.size();
+
+	// the grid starts on a tile boundary below the lowest translation
+	float minX = FLT_MAX, minZ = FLT_MAX, maxX = -FLT_MAX, maxZ = -FLT_MAX;
+	for (const auto& instance : instances) {
+		minX = std::min(minX, instance.transform[9]);
+		maxX = std::max(maxX, instance.transform[9]);
+		minZ = std::min(minZ, instance.transform[11]);
+		maxZ = std::max(maxZ, instance.transform[11]);
+	}
+	std::vector<uint32_t> tileOf(instances.size());
+	if (!instances.empty()) {
+		header.originX = floorf(minX / tileSize) * tileSize;
+		header.originZ = floorf(minZ / tileSize) * tileSize;
+		header.tilesX = (uint32_t)((maxX - header.originX) / tileSize) + 1;
+		header.tilesZ = (uint32_t)((maxZ - header.originZ) / tileSize) + 1;
+		for (size_t i = 0; i < instances.size(); i++) {
+			uint32_t x = std::min((uint32_t)((instances[i].transform[9] - header.originX) / tileSize),
+				header.tilesX - 1);
+			uint32_t z = std::min((uint32_t)((instances[i].transform[11] - header.originZ) / tileSize),
+				header.tilesZ - 1);
+			tileOf[i] = z * header.tilesX + x;
+		}
+	}
+
+	// counting sort by tile, the instances of a tile stay in their order
+	std::vector<ForestTileEntry> entries(header.tilesX * header.tilesZ);
+	memset(entries.data(), 0, entries.size() * sizeof(ForestTileEntry));
+	for (uint32_t tile : tileOf) entries[tile].instanceCount++;
+	uint64_t first = 0;
+	for (auto& entry : entries) {
+		entry.firstInstance = first;
+		first += entry.instanceCount;
+	}
+	std::vector<ForestInstance> sorted(instances.size());
+	std::vector<uint32_t> fill(entries.size(), 0);
+	for (size_t i = 0; i < instances.size(); i++) {
+		sorted[(size_t)entries[tileOf[i]].firstInstance + fill[tileOf[i]]++] = instances[i];
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == NULL) {
+		throw std::runtime_error("Failed to create " + path + "\n");
+	}
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (!entries.empty()) {
+		written &= fwrite(entries.data(), sizeof(ForestTileEntry), entries.size(), file) == entries.size();
+	}
+	if (!sorted.empty()) {
+		written &= fwrite(sorted.data(), sizeof(ForestInstance), sorted.size(), file) == sorted.size();
+	}
+	written &= fclose(file) == 0;
+	if (!written) {
+		throw std::runtime_error("Failed to write " + path + "\n");
+	}
+}
+
+ForestStreamer::ForestStreamer(const std::string& path, int radius) :
+	tiles(NULL), radius(std::max(radius, 0)), stop(false) {
+	file.open(path);
+	if (file.size() < sizeof(ForestHeader)) {
+		throw std::runtime_error("Invalid forest " + path + "\n");
+	}
+	memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+	if (memcmp(fileHeader.magic, forestMagic, 4) != 0 ||
+		fileHeader.version != FOREST_VERSION || !(fileHeader.tileSize > 0.0f) ||
+		fileHeader.tilesX > INT_MAX || fileHeader.tilesZ > INT_MAX) {
+		throw std::runtime_error("Invalid forest " + path + "\n");
+	}
+
+	// sizes are compared by division against what is left of the file, a
+	// corrupt count cannot wrap around
+	uint64_t tileCount = (uint64_t)fileHeader.tilesX * fileHeader.tilesZ;
+	uint64_t remaining = file.size() - sizeof(ForestHeader);
+	if (tileCount > remaining / sizeof(ForestTileEntry)) {
+		throw std::runtime_error("Truncated forest " + path + "\n");
+	}
+	remaining -= tileCount * sizeof(ForestTileEntry);
+	if (fileHeader.instanceCount > remaining / sizeof(ForestInstance)) {
+		throw std::runtime_error("Truncated forest " + path + "\n");
+	}
+	// the header is 40 bytes and the entries 16, both stay 8 byte aligned
+	tiles = (const ForestTileEntry*)(file.data() + sizeof(ForestHeader));
+	for (uint64_t i = 0; i < tileCount; i++) {
+		if (tiles[i].firstInstance > fileHeader.instanceCount ||
+			tiles[i].instanceCount > fileHeader.instanceCount - tiles[i].firstInstance) {
+			throw std::runtime_error("Invalid forest " + path + "\n");
+		}
+	}
+
+	thread = std::thread(&ForestStreamer::loaderLoop, this);
+}
+
+ForestStreamer::~ForestStreamer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_one();
+	thread.join();
+	for (ForestTile* tile : finished) delete tile;
+}
+
+void ForestStreamer::update(const glm::vec3& position, std::vector<ForestTile*>& loaded,
+	std::vector<std::pair<int, int>>& retired) {
+	int centerX = (int)floorf((position.x - fileHeader.originX) / fileHeader.tileSize);
+	int centerZ = (int)floorf((position.z - fileHeader.originZ) / fileHeader.tileSize);
+	auto distance = [&](const TileCoordinates& tile) {
+		return std::max(abs(tile.first - centerX), abs(tile.second - centerZ));
+	};
+	const unsigned char* instances = file.data() + sizeof(ForestHeader) +
+		(size_t)fileHeader.tilesX * fileHeader.tilesZ * sizeof(ForestTileEntry);
+
+	std::vector<TileCoordinates> missing;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// retire the tiles out of range, a tile still loading is dropped when
+		// it finishes
+		for (auto it = wanted.begin(); it != wanted.end();) {
+			if (distance(*it) <= radius + 1) {
+				++it;
+				continue;
+			}
+			if (delivered.erase(*it) > 0) {
+				retired.push_back(*it);
+				const ForestTileEntry& entry = tileEntry(*it);
+				file.release(instances - file.data() + entry.firstInstance * sizeof(ForestInstance),
+					entry.instanceCount * sizeof(ForestInstance));
+			}
+			it = wanted.erase(it);
+		}
+		requests.erase(std::remove_if(requests.begin(), requests.end(),
+			[&](const TileCoordinates& tile) { return wanted.count(tile) == 0; }), requests.end());
+
+		// request the tiles coming into range, nearest first
+		for (int z = std::max(centerZ - radius, 0);
+			z <= std::min(centerZ + radius, (int)fileHeader.tilesZ - 1); z++) {
+			for (int x = std::max(centerX - radius, 0);
+				x <= std::min(centerX + radius, (int)fileHeader.tilesX - 1); x++) {
+				if (wanted.insert(TileCoordinates(x, z)).second) missing.push_back(TileCoordinates(x, z));
+			}
+		}
+		std::sort(missing.begin(), missing.end(), [&](const TileCoordinates& a, const TileCoordinates& b) {
+			return distance(a) < distance(b);
+		});
+		requests.insert(requests.end(), missing.begin(), missing.end());
+
+		// a tile retired while it was loading and requested again can finish
+		// twice, the first copy is delivered and its pending request dropped
+		for (ForestTile* tile : finished) {
+			TileCoordinates coordinates(tile->x, tile->z);
+			if (wanted.count(coordinates) == 0 || !delivered.insert(coordinates).second) {
+				delete tile;
+				continue;
+			}
+			auto request = std::find(requests.begin(), requests.end(), coordinates);
+			if (request != requests.end()) requests.erase(request);
+			loaded.push_back(tile);
+		}
+		finished.clear();
+	}
+	if (!missing.empty()) wake.notify_one();
+}
+
+void ForestStreamer::loaderLoop() {
+	const ForestInstance* instances = (const ForestInstance*)(file.data() + sizeof(ForestHeader) +
+		(size_t)fileHeader.tilesX * fileHeader.tilesZ * sizeof(ForestTileEntry));
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this] { return stop || !requests.empty(); });
+		if (stop) return;
+		TileCoordinates coordinates = requests.front();
+		requests.pop_front();
+		lock.unlock();
+
+		// touching the mapping here is what pages the tile in
+		const ForestTileEntry& entry = tileEntry(coordinates);
+		ForestTile* tile = new ForestTile();
+		tile->x = coordinates.first;
+		tile->z = coordinates.second;
+		tile->instances.assign(instances + entry.firstInstance,
+			instances + entry.firstInstance + entry.instanceCount);
+
+		lock.lock();
+		finished.push_back(tile);
+	}
+}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#define W_WIDTH 1024
+#define W_HEIGHT 768
+#define TITLE "Lab 05"
+#define LOD_HYSTERESIS 0.15f
+#define IMPOSTOR_WIDTH 256
+#define IMPOSTOR_HEIGHT 512
+#define SIMULATION_SEED 1
+#define SIMULATION_STEPS_PER_FRAME 4
+#define SNAPSHOT_INTERVAL 5.0  // simulated seconds between snapshots
+#define SHADOW_MAP_SIZE 2048
+#define DRAG_STIFFNESS 2.0e4f  // force per unit the dragged point lags behind the view ray
+#define TREE_SPECIES 1  // the maple, the only species with meshes and textures
+
+void defineJointPoints();
+Skeleton* createTreeSkeleton();
+void createLODLevels();
+LODMesh* bakeImpostor();
+struct PassState;
+void drawTree(const TreeInstance& tree, const PassState& pass);
+void usePassVariant(unsigned int variant, const PassState& pass);
+void skinTrees(BonePalette& palette);
+void createShadowMap();
+mat4 calculateLightViewProjection();
+struct TreeGroup;
+vector<TreeGroup> treeGroups();
+void renderTrees(const vector<TreeGroup>& groups, const mat4& viewMatrix, const mat4& projectionMatrix,
+	const mat4& lightViewProjection);
+void drawTreeGroups(const vector<TreeGroup>& groups, PassState& pass);
+void cullTrees(vector<TreeInstance>& instances, const vector<RigidTransform>& T,
+	const mat4& viewMatrix, const mat4& projectionMatrix, const mat4& lightViewProjection);
+void sortLeaves(vector<TreeInstance>& instances, const vector<RigidTransform>& T, const mat4& viewMatrix);
+void uploadBonePalette(BonePalette& palette);
+void useShaderVariant(unsigned int variant);
+SimulationState createSimulation(uint64_t seed);
+map<int, float> simulationCoordinates(const SimulationState& state);
+int runBatch(int argc, char** argv);
+int cookTextures(int argc, char** argv);
+GLuint loadTexture(const char* path);
+void calculateJointWorldTransformations(const SimulationState& state, vector<RigidTransform>& world);
+void createBoneCapsules();
+void updateContactForces(SimulationState& state);
+void addGeneralizedForce(SimulationState& state, const vector<RigidTransform>& world, int bone,
+	const vec3& point, const vec3& force);
+PickHit pickTrees(const vec3& origin, const vec3& direction, int& tree);
+void applyPointForce(int tree, int bone, const vec3& localPoint, const vec3& force);
+void updateDrag(const mat4& viewMatrix);
+int makeForest(int argc, char** argv);
+void updateForest(const vec3& cameraPosition);
+void updatePaletteFromSimulation(const SimulationState& state, BonePalette& palette);
+struct Light; struct Material;
+void uploadMaterial(const Material& mtl);
+void uploadLight(const Light& light);
+
+
+// Global variables
+GLFWwindow* window;
+Camera* camera;
+GLuint shaderProgram;
+GLuint projectionMatrixLocation, viewMatrixLocation, modelMatrixLocation, modelMatrixLocation2, planeLocation;
+GLuint diffuceColorSampler, specularColorSampler;
+GLuint diffuseTexturetree, specularTexturetree, diffuseTextureleaves, specularTextureleaves;
+GLuint treeVAO, leavesVAO, planeVAO;
+GLuint treeVerticiesVBO, treeUVVBO, treeNormalsVBO, leavesVerticiesVBO, leavesUVVBO, leavesNormalsVBO, planeColorsVAO, planeColorsVBO, planeVerticiesVBO;
+std::vector<vec3> objVerticestree, objNormalstree, objVerticesleaves, objNormalsleaves;
+std::vector<vec2> objUVstree, objUVsleaves;
+std::vector<vec3> treeJoints;
+Skeleton* skeleton;
+// light properties
+GLuint LaLocation, LdLocation, LsLocation, lightPositionLocation, lightPowerLocation;
+// material properties
+GLuint KdLocation, KsLocation, KaLocation, NsLocation;
+Drawable *segment, *skeletonSkin;
+// compiled on first use, selected per draw
+ShaderProgram shaderVariants[SHADER_VARIANTS];
+ShaderProgram* currentProgram = NULL;
+string vertexShaderSource, fragmentShaderSource;
+GLuint surfaceVAO, surfaceVerticesVBO, surfacesBoneIndecesVBO, maleBoneIndicesVBO;
+// simulation
+DynamicsParameters dynamicsParameters;
+SimulationState simulation;
+SnapshotWriter* snapshotWriter = NULL;
+double nextSnapshotTime = SNAPSHOT_INTERVAL;
+// collisions
+const vec4 groundPlane(0, 1, 0, 0);  // the plane drawn at y = 0
+vector<int> jointParents;  // -1 for the root and for joints not in the skeleton
+vector<RigidTransform> bindInverses;  // identity for joints not in the skeleton
+vector<RigidTransform> contactWorld, contactSkinning;  // reused every step
+vector<Capsule> boneCapsules;  // one per skinned bone, model space at the binding pose
+vector<Capsule> sceneCapsules;
+SweepAndPrune broadphase;
+vector<Contact> contacts;
+// picking and forces applied to branches for the next frame
+PickingBVH pickingBVH;
+struct PointForce {
+	int tree, bone;
+	vec3 localPoint;  // at the binding pose, model space
+	vec3 force;  // world space
+};
+vector<PointForce> pointForces;
+// the branch dragged with the mouse, tree is -1 when none
+struct BranchDrag {
+	int tree, bone;
+	vec3 localPoint;
+	float distance;  // along the view ray
+} drag = { -1, -1, vec3(0.0f), 0.0f };
+// level of detail
+std::vector<LODLevel> lodLevels;
+std::vector<TreeInstance> trees;
+GLuint impostorTexture, impostorFBO, impostorDepthRBO;
+// culling
+std::vector<AABB> trunkBoneBounds;
+std::vector<LeafCluster> leafClusters;
+GLuint leavesBoneIndicesVBO;
+// leaf sorting
+ThreadPool* threadPool;
+LeafSortScratch leafSortScratch;
+std::vector<vec3> leafCentroids;
+std::vector<int> leafTriangleBones, leafTriangleClusters;
+GLuint leavesElementVBO;
+// offscreen rendering, frames go to frameFBO instead of the window
+bool offscreen = false;
+OffscreenContext* offscreenContext = NULL;
+FrameExporter* frameExporter = NULL;
+GLuint frameFBO = 0, frameColorRBO, frameDepthRBO;
+int viewportWidth = W_WIDTH, viewportHeight = W_HEIGHT;
+unsigned int offscreenFrames = 250;
+string framePrefix = "frame";
+// full detail trunk and leaves, skinned once per frame
+SkinnedMesh *trunkSkin = NULL, *leavesSkin = NULL;
+unsigned int skinnedPaletteId = 0, skinnedPaletteRevision = 0;  // the pose they hold
+GLuint shadowMapFBO, shadowMapTexture;
+// pose tracks
+PoseTrackWriter* poseRecorder = NULL;
+PoseTrackReader* posePlayer = NULL;
+unsigned int playbackFrame = 0;
+// streamed forest, the tiles of trees around the camera
+ForestStreamer* forestStreamer = NULL;
+int forestRadius = 2;  // in tiles
+vec3 treeBoundsCenter;  // model space bounding sphere of the species
+float treeBoundsRadius;
+
+struct Light {
 	glm::vec4 La;
 	glm::vec4 Ld;
 	glm::vec4 Ls;
@@ -280,147 +4816,501 @@ enum CoordinateName {
 	LUMBAR_FLEX, LUMBAR_BEND, LUMBAR_ROT, DOFS
 };
 
-// Joint names for mnemonic indexing
-enum JointName {
-	//BASE = 0, HIP_R, KNEE_R, ANKLE_R, SUBTALAR_R, MTP_R, HIP_L, KNEE_L, ANKLE_L, SUBTALAR_L, MTP_L, BACK, JOINTS
-	ROOT = 0, POINT2, POINT3, POINT4, POINT5, POINT6, POINT7, POINT8, POINT9, POINT10, POINT11, POINT12, JOINTS
-};
+// Joint names for mnemonic indexing
+enum JointName {
+	//BASE = 0, HIP_R, KNEE_R, ANKLE_R, SUBTALAR_R, MTP_R, HIP_L, KNEE_L, ANKLE_L, SUBTALAR_L, MTP_L, BACK, JOINTS
+	ROOT = 0, POINT2, POINT3, POINT4, POINT5, POINT6, POINT7, POINT8, POINT9, POINT10, POINT11, POINT12, JOINTS
+};
+
+// Body names for mnemonic indexing
+enum BodyName {
+	//PELVIS = 0, FEMUR_R, TIBIA_R, TALUS_R, CALCN_R, TOES_R, FEMUR_L, TIBIA_L, TALUS_L, CALCN_L, TOES_L, TORSO, BODIES
+	BONE1 = 0, BONE2, BONE3, BONE4, BONE5, BONE6, BONE7, BONE8, BONE9, BONE10, BONE11, BONE12, BONE13
+};
+
+// default pose used for binding the skeleton and the mesh
+static const map<int, float> bindingPose = {
+	{ CoordinateName::BONE1_TRA_X, 0.0f },
+	{ CoordinateName::BONE1_TRA_Y, 0.0f },
+	{ CoordinateName::BONE1_TRA_Z, 0.0f },
+	{ CoordinateName::HIP_R_FLEX, 3.0f },
+	{ CoordinateName::HIP_R_ADD, -5.0f },
+	{ CoordinateName::HIP_R_ROT, 0.0f },
+	{ CoordinateName::KNEE_R_FLEX, -15.0f },
+	{ CoordinateName::ANKLE_R_FLEX, 15.0f },
+	{ CoordinateName::HIP_L_FLEX, 3.0f },
+	{ CoordinateName::HIP_L_ADD, -5.0f },
+	{ CoordinateName::HIP_L_ROT, 0.0f },
+	{ CoordinateName::KNEE_L_FLEX, -15.0f },
+	{ CoordinateName::ANKLE_L_FLEX, 15.0f },
+	{ CoordinateName::LUMBAR_FLEX, 0.0f },
+	{ CoordinateName::LUMBAR_BEND, 0.0f },
+	{ CoordinateName::LUMBAR_ROT, 0.0f }
+};
+
+unsigned int bonePaletteCount = 0;
+
+// skinning transformations, every program is sent only the bones changed
+// since the revision it got last
+struct BonePalette {
+	vector<RigidTransform> transformations;
+	vector<BoneMatrix> matrices;
+	vector<unsigned int> boneRevisions;  // revision each bone last changed in
+	unsigned int id, revision;
+	map<int, float> evaluatedCoordinates;  // coordinates the pose was built from
+
+	BonePalette() :
+		transformations(JointName::JOINTS),
+		matrices(JointName::JOINTS, RigidTransform().toBoneMatrix()),
+		boneRevisions(JointName::JOINTS, 1),
+		id(++bonePaletteCount), revision(1) {}
+};
+
+BonePalette bonePalette;
+
+// the passes drawing the trees, the full detail meshes are skinned once per
+// frame and every pass reuses them
+enum RenderPass { SHADOW_PASS, DEPTH_PASS, MAIN_PASS };
+
+struct PassState {
+	RenderPass pass;
+	mat4 viewMatrix, projectionMatrix;
+	mat4 lightViewProjection;
+	bool shadowed;  // sample the shadow map in the main pass
+	BonePalette* palette;  // pose of the trees drawn, see drawTree
+};
+
+// trees drawn with one pose, the hero trees and each streamed tile
+struct TreeGroup {
+	vector<TreeInstance>* trees;
+	BonePalette* palette;
+};
+
+// a streamed tile, its trees sway together with a simulation created and
+// retired with the tile
+struct ResidentTile {
+	int x, z;
+	vector<TreeInstance> trees;
+	SimulationState simulation;
+	BonePalette palette;
+};
+
+vector<ResidentTile*> residentTiles;
+
+// locations of the individual palette entries, for partial uploads
+static_assert(JointName::JOINTS <= MAX_BONES, "the shader palette is too small");
+GLint boneTransformationLocations[JointName::JOINTS];
+
+// coordinates driving each joint, joints missing here have a fixed pose
+static const map<int, int> coordinateJoints = {
+	{ CoordinateName::BONE1_TRA_X, JointName::ROOT },
+	{ CoordinateName::BONE1_TRA_Y, JointName::ROOT },
+	{ CoordinateName::BONE1_TRA_Z, JointName::ROOT },
+	{ CoordinateName::HIP_R_FLEX, JointName::POINT2 },
+	{ CoordinateName::HIP_R_ADD, JointName::POINT2 },
+	{ CoordinateName::HIP_R_ROT, JointName::POINT2 },
+	{ CoordinateName::KNEE_R_FLEX, JointName::POINT3 },
+	{ CoordinateName::ANKLE_R_FLEX, JointName::POINT4 },
+	{ CoordinateName::LUMBAR_FLEX, JointName::POINT7 },
+	{ CoordinateName::LUMBAR_BEND, JointName::POINT7 },
+	{ CoordinateName::LUMBAR_ROT, JointName::POINT7 }
+};
+
+// joints with a local transformation
+static const int posedJoints[] = {
+	JointName::ROOT, JointName::POINT2, JointName::POINT3, JointName::POINT4,
+	JointName::POINT5, JointName::POINT6, JointName::POINT7
+};
+
+// how strongly the wind bends each coordinate, the rest do not respond
+static const map<int, float> coordinateWindResponse = {
+	{ CoordinateName::HIP_R_FLEX, 20.0f },
+	{ CoordinateName::HIP_R_ADD, 8.0f },
+	{ CoordinateName::HIP_R_ROT, 4.0f },
+	{ CoordinateName::KNEE_R_FLEX, 30.0f },
+	{ CoordinateName::ANKLE_R_FLEX, 40.0f },
+	{ CoordinateName::LUMBAR_FLEX, 30.0f },
+	{ CoordinateName::LUMBAR_BEND, 12.0f },
+	{ CoordinateName::LUMBAR_ROT, 4.0f }
+};
+
+SimulationState createSimulation(uint64_t seed) {
+	SimulationState state;
+	state.rngState = seed != 0 ? seed : 1;  // xorshift never leaves zero
+	state.rest.assign(CoordinateName::DOFS, 0.0f);
+	for (const auto& coordinate : bindingPose) {
+		state.rest[coordinate.first] = coordinate.second;
+	}
+	state.q = state.rest;
+	state.qdot.assign(CoordinateName::DOFS, 0.0f);
+	state.windResponse.assign(CoordinateName::DOFS, 0.0f);
+	for (const auto& coordinate : coordinateWindResponse) {
+		state.windResponse[coordinate.first] = coordinate.second;
+	}
+	return state;
+}
+
+map<int, float> simulationCoordinates(const SimulationState& state) {
+	map<int, float> q;
+	for (int i = 0; i < (int)state.q.size(); i++) {
+		q[i] = state.q[i];
+	}
+	return q;
+}
+
+// coordinates rotating a joint about one of its local axes, contact forces
+// are mapped back to them
+static const struct {
+	int coordinate, joint;
+	vec3 axis;
+} rotationalCoordinates[] = {
+	{ CoordinateName::HIP_R_ADD, JointName::POINT2, vec3(1, 0, 0) },
+	{ CoordinateName::HIP_R_ROT, JointName::POINT2, vec3(0, 1, 0) },
+	{ CoordinateName::HIP_R_FLEX, JointName::POINT2, vec3(0, 0, 1) },
+	{ CoordinateName::KNEE_R_FLEX, JointName::POINT3, vec3(0, 0, 1) },
+	{ CoordinateName::ANKLE_R_FLEX, JointName::POINT4, vec3(0, 0, 1) },
+	{ CoordinateName::LUMBAR_BEND, JointName::POINT7, vec3(1, 0, 0) },
+	{ CoordinateName::LUMBAR_ROT, JointName::POINT7, vec3(0, 1, 0) },
+	{ CoordinateName::LUMBAR_FLEX, JointName::POINT7, vec3(0, 0, 1) }
+};
+
+// q is a coordinate map or the simulation's coordinate vector
+template<class Coordinates>
+RigidTransform calculateJointLocalTransformation(int joint, Coordinates& q) {
+	switch (joint) {
+	case JointName::ROOT: {
+		// base / pelvis joint
+		return RigidTransform(quat(), vec3(
+			q[CoordinateName::BONE1_TRA_X],
+			q[CoordinateName::BONE1_TRA_Y],
+			q[CoordinateName::BONE1_TRA_Z]));
+	}
+	case JointName::POINT2: {
+		// right hip joint
+		vec3 POINT2Offset = treeJoints[0];
+		quat hipRRotX = angleAxis(radians(q[CoordinateName::HIP_R_ADD]), vec3(1, 0, 0));
+		quat hipRRotY = angleAxis(radians(q[CoordinateName::HIP_R_ROT]), vec3(0, 1, 0));
+		quat hipRRotZ = angleAxis(radians(q[CoordinateName::HIP_R_FLEX]), vec3(0, 0, 1));
+		return RigidTransform(hipRRotX * hipRRotY * hipRRotZ, POINT2Offset);
+	}
+	case JointName::POINT3: {
+		// right knee joint
+		vec3 kneeROffset = treeJoints[1];
+		quat kneeRRotZ = angleAxis(radians(q[CoordinateName::KNEE_R_FLEX]), vec3(0, 0, 1));
+		return RigidTransform(kneeRRotZ, kneeROffset);
+	}
+	case JointName::POINT4: {
+		// right ankle joint
+		vec3 ankleROffset = treeJoints[2];
+		quat ankleRRotZ = angleAxis(radians(q[CoordinateName::ANKLE_R_FLEX]), vec3(0, 0, 1));
+		return RigidTransform(ankleRRotZ, ankleROffset);
+	}
+	case JointName::POINT5:
+		// right calcn joint
+		return RigidTransform(quat(), treeJoints[4]);
+	case JointName::POINT6:
+		// right mtp joint
+		return RigidTransform(quat(), treeJoints[5]);
+	case JointName::POINT7: {
+		// back joint
+		vec3 backOffset = treeJoints[6];
+		quat lumbarRotX = angleAxis(radians(q[CoordinateName::LUMBAR_BEND]), vec3(1, 0, 0));
+		quat lumbarRotY = angleAxis(radians(q[CoordinateName::LUMBAR_ROT]), vec3(0, 1, 0));
+		quat lumbarRotZ = angleAxis(radians(q[CoordinateName::LUMBAR_FLEX]), vec3(0, 0, 1));
+		return RigidTransform(lumbarRotX * lumbarRotY * lumbarRotZ, backOffset);
+	}
+	default:
+		return RigidTransform();
+	}
+}
+
+map<int, RigidTransform> calculateModelPoseFromCoordinates(map<int, float> q) {
+	map<int, RigidTransform> jointLocalTransformations;
+	for (int joint : posedJoints) {
+		jointLocalTransformations[joint] = calculateJointLocalTransformation(joint, q);
+	}
+	return jointLocalTransformations;
+}
+
+map<int, RigidTransform> calculateChangedJointTransformations(map<int, float> q,
+	map<int, float>& evaluatedCoordinates) {
+	// everything is new the first time
+	if (evaluatedCoordinates.empty()) {
+		for (const auto& coordinate : coordinateJoints) {
+			evaluatedCoordinates[coordinate.first] = q[coordinate.first];
+		}
+		return calculateModelPoseFromCoordinates(q);
+	}
+
+	set<int> changedJoints;
+	for (const auto& coordinate : coordinateJoints) {
+		float value = q[coordinate.first];
+		float& evaluated = evaluatedCoordinates[coordinate.first];
+		if (value != evaluated) {
+			evaluated = value;
+			changedJoints.insert(coordinate.second);
+		}
+	}
+
+	map<int, RigidTransform> jointLocalTransformations;
+	for (int joint : changedJoints) {
+		jointLocalTransformations[joint] = calculateJointLocalTransformation(joint, q);
+	}
+	return jointLocalTransformations;
+}
+
+void calculateJointWorldTransformations(const SimulationState& state, vector<RigidTransform>& world) {
+	// same as the skeleton, without touching the pose it renders; runs every
+	// step, so straight from state.q into the caller's buffer
+	world.resize(JointName::JOINTS);
+	for (int joint : posedJoints) {
+		RigidTransform local = calculateJointLocalTransformation(joint, state.q);
+		int parent = jointParents[joint];
+		world[joint] = parent < 0 ? local : world[parent] * local;
+	}
+}
+
+void createBoneCapsules() {
+	jointParents.assign(JointName::JOINTS, -1);
+	bindInverses.assign(JointName::JOINTS, RigidTransform());
+	for (const auto& joint : skeleton->joints) {
+		for (const auto& other : skeleton->joints) {
+			if (other.second == joint.second->parent) jointParents[joint.first] = other.first;
+		}
+		bindInverses[joint.first] = joint.second->jointBindTransformation.inverse();
+	}
+
+	// a capsule along the longest side of each bone's bounds at the binding
+	// pose, as thick as the other two sides on average
+	boneCapsules.clear();
+	for (int bone = 0; bone < (int)trunkBoneBounds.size(); bone++) {
+		const AABB& box = trunkBoneBounds[bone];
+		if (box.min.x > box.max.x) continue;
+		vec3 extent = box.max - box.min, center = (box.min + box.max) * 0.5f;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		Capsule capsule;
+		capsule.radius = (extent[(axis + 1) % 3] + extent[(axis + 2) % 3]) * 0.25f;
+		vec3 half(0.0f);
+		half[axis] = std::max(extent[axis] * 0.5f - capsule.radius, 0.0f);
+		capsule.a = center - half;
+		capsule.b = center + half;
+		capsule.tree = 0;
+		capsule.bone = bone;
+		capsule.ignoredBones = 0;
+		boneCapsules.push_back(capsule);
+	}
+
+	// bones already touching at the binding pose (neighbours mostly) are
+	// part of the shape, not contacts
+	for (Capsule& c0 : boneCapsules) {
+		for (const Capsule& c1 : boneCapsules) {
+			vec3 p, q;
+			closestPointsSegmentSegment(c0.a, c0.b, c1.a, c1.b, p, q);
+			if (length(p - q) < c0.radius + c1.radius ||
+				jointParents[c0.bone] == c1.bone || jointParents[c1.bone] == c0.bone) {
+				c0.ignoredBones |= 1u << c1.bone;
+			}
+		}
+	}
+}
+
+void updateContactForces(SimulationState& state) {
+	vector<RigidTransform>& world = contactWorld;
+	vector<RigidTransform>& skinning = contactSkinning;
+	calculateJointWorldTransformations(state, world);
+	skinning.resize(JointName::JOINTS);
+	for (int bone = 0; bone < JointName::JOINTS; bone++) {
+		skinning[bone] = world[bone] * bindInverses[bone];
+	}
+
+	// every tree instance replays the one simulation, so all of their
+	// contacts load it; the capsules are written over in place
+	sceneCapsules.resize(trees.size() * boneCapsules.size());
+	Capsule* capsule = sceneCapsules.data();
+	for (int t = 0; t < (int)trees.size(); t++) {
+		const mat4& M = trees[t].modelMatrix;
+		float scale = length(vec3(M[0]));
+		for (const Capsule& bone : boneCapsules) {
+			const RigidTransform& T = skinning[bone.bone];
+			*capsule = bone;
+			capsule->a = vec3(M * vec4(T.transformPoint(bone.a), 1.0f));
+			capsule->b = vec3(M * vec4(T.transformPoint(bone.b), 1.0f));
+			capsule->radius *= scale;
+			capsule->tree = t;
+			capsule++;
+		}
+	}
+	findContacts(sceneCapsules, broadphase, groundPlane, dynamicsParameters.contactStiffness,
+		contacts);
+
+	state.externalForce.assign(state.q.size(), 0.0f);
+	for (const Contact& contact : contacts) {
+		const Capsule& capsule = sceneCapsules[contact.capsule];
+		const mat4& M = trees[capsule.tree].modelMatrix;
+		vec3 point = vec3(inverse(M) * vec4(contact.point, 1.0f));
+		addGeneralizedForce(state, world, capsule.bone, point, transpose(mat3(M)) * contact.force);
+	}
+
+	// pulls and pushes of applyPointForce, on the point as the bone moves now
+	for (const PointForce& f : pointForces) {
+		const mat4& M = trees[f.tree].modelMatrix;
+		addGeneralizedForce(state, world, f.bone, skinning[f.bone].transformPoint(f.localPoint),
+			transpose(mat3(M)) * f.force);
+	}
+}
+
+void addGeneralizedForce(SimulationState& state, const vector<RigidTransform>& world, int bone,
+	const vec3& point, const vec3& force) {
+	// generalized force of a rotation: the moment about its axis, per degree
+	for (const auto& c : rotationalCoordinates) {
+		// only the joint moving the bone and its ancestors respond
+		int joint = bone;
+		while (joint >= 0 && joint != c.joint) joint = jointParents[joint];
+		if (joint < 0) continue;
+
+		// the outer rotations of a joint use its final frame, close enough
+		// for a penalty response
+		vec3 axis = world[c.joint].transformVector(c.axis);
+		vec3 arm = point - world[c.joint].translation;
+		state.externalForce[c.coordinate] += dot(cross(axis, arm), force) *
+			radians(1.0f);
+	}
+}
 
-// Body names for mnemonic indexing
-enum BodyName {
-	//PELVIS = 0, FEMUR_R, TIBIA_R, TALUS_R, CALCN_R, TOES_R, FEMUR_L, TIBIA_L, TALUS_L, CALCN_L, TOES_L, TORSO, BODIES
-	BONE1 = 0, BONE2, BONE3, BONE4, BONE5, BONE6, BONE7, BONE8, BONE9, BONE10, BONE11, BONE12, BONE13
-};
+PickHit pickTrees(const vec3& origin, const vec3& direction, int& tree) {
+	// the instances share one pose, so the ray goes into each model space
+	// instead; the direction is not normalized again so the ray parameter
+	// stays the world distance
+	PickHit nearest;
+	nearest.bone = -1;
+	nearest.distance = FLT_MAX;
+	tree = -1;
+	for (int t = 0; t < (int)trees.size(); t++) {
+		mat4 toModel = inverse(trees[t].modelMatrix);
+		PickHit hit = pickingBVH.rayCast(vec3(toModel * vec4(origin, 1.0f)),
+			mat3(toModel) * direction, nearest.distance);
+		if (hit.bone < 0) continue;
+		nearest = hit;
+		nearest.point = vec3(trees[t].modelMatrix * vec4(hit.point, 1.0f));
+		tree = t;
+	}
+	return nearest;
+}
 
-// default pose used for binding the skeleton and the mesh
-static const map<int, float> bindingPose = {
-	{ CoordinateName::BONE1_TRA_X, 0.0f },
-	{ CoordinateName::BONE1_TRA_Y, 0.0f },
-	{ CoordinateName::BONE1_TRA_Z, 0.0f },
-	{ CoordinateName::HIP_R_FLEX, 3.0f },
-	{ CoordinateName::HIP_R_ADD, -5.0f },
-	{ CoordinateName::HIP_R_ROT, 0.0f },
-	{ CoordinateName::KNEE_R_FLEX, -15.0f },
-	{ CoordinateName::ANKLE_R_FLEX, 15.0f },
-	{ CoordinateName::HIP_L_FLEX, 3.0f },
-	{ CoordinateName::HIP_L_ADD, -5.0f },
-	{ CoordinateName::HIP_L_ROT, 0.0f },
-	{ CoordinateName::KNEE_L_FLEX, -15.0f },
-	{ CoordinateName::ANKLE_L_FLEX, 15.0f },
-	{ CoordinateName::LUMBAR_FLEX, 0.0f },
-	{ CoordinateName::LUMBAR_BEND, 0.0f },
-	{ CoordinateName::LUMBAR_ROT, 0.0f }
-};
+void applyPointForce(int tree, int bone, const vec3& localPoint, const vec3& force) {
+	// held for the simulation steps of the next frame, call every frame to
+	// keep pulling
+	pointForces.push_back(PointForce{ tree, bone, localPoint, force });
+}
 
-map<int, mat4> calculateModelPoseFromCoordinates(map<int, float> q) {
-	map<int, mat4> jointLocalTransformations;
-
-	// base / pelvis joint
-	mat4 bone1tra = translate(mat4(), vec3(
-		q[CoordinateName::BONE1_TRA_X],
-		q[CoordinateName::BONE1_TRA_Y],
-		q[CoordinateName::BONE1_TRA_Z]));
-	jointLocalTransformations[JointName::ROOT] = bone1tra;
-
-	// right hip joint
-	vec3 POINT2Offset = treeJoints[0];
-	mat4 hipRTra = translate(mat4(), POINT2Offset);
-	mat4 hipRRotX = rotate(mat4(), radians(q[CoordinateName::HIP_R_ADD]), vec3(1, 0, 0));
-	mat4 hipRRotY = rotate(mat4(), radians(q[CoordinateName::HIP_R_ROT]), vec3(0, 1, 0));
-	mat4 hipRRotZ = rotate(mat4(), radians(q[CoordinateName::HIP_R_FLEX]), vec3(0, 0, 1));
-	jointLocalTransformations[JointName::POINT2] = hipRTra * hipRRotX * hipRRotY * hipRRotZ;
-
-	// right knee joint
-	vec3 kneeROffset = treeJoints[1];
-	mat4 kneeRTra = translate(mat4(1.0), kneeROffset);
-	mat4 kneeRRotZ = rotate(mat4(), radians(q[CoordinateName::KNEE_R_FLEX]), vec3(0, 0, 1));
-	jointLocalTransformations[JointName::POINT3] = kneeRTra * kneeRRotZ;
-
-	// right ankle joint
-	vec3 ankleROffset = treeJoints[2];
-	mat4 ankleRTra = translate(mat4(1.0), ankleROffset);
-	mat4 ankleRRotZ = rotate(mat4(), radians(q[CoordinateName::ANKLE_R_FLEX]), vec3(0, 0, 1));
-	mat4 talusRModelMatrix = ankleRRotZ;
-	jointLocalTransformations[JointName::POINT4] = ankleRTra * ankleRRotZ;
-
-	// right calcn joint
-	vec3 calcnROffset = treeJoints[4];
-	mat4 calcnRTra = translate(mat4(1.0), calcnROffset);
-	jointLocalTransformations[JointName::POINT5] = calcnRTra;
-
-	// right mtp joint
-	vec3 toesROffset = treeJoints[5];
-	mat4 mtpRTra = translate(mat4(1.0), toesROffset);
-	jointLocalTransformations[JointName::POINT6] = mtpRTra;
-
-	///////////////////////////////////////	LEFT
-	//// left hip joint
-	//vec3 hipLOffset = treeJoints[7];
-	//mat4 hipLTra = translate(mat4(), hipLOffset);
-	//mat4 hipLRotX = rotate(mat4(), radians(q[CoordinateName::HIP_L_ADD]), vec3(1, 0, 0));
-	//mat4 hipLRotY = rotate(mat4(), radians(q[CoordinateName::HIP_L_ROT]), vec3(0, 1, 0));
-	//mat4 hipLRotZ = rotate(mat4(), radians(q[CoordinateName::HIP_L_FLEX]), vec3(0, 0, 1));
-	//jointLocalTransformations[JointName::POINT7] = hipLTra * hipLRotX * hipLRotY * hipLRotZ;
-
-	//// left knee joint
-	//vec3 kneeLOffset = treeJoints[8];
-	//mat4 kneeLTra = translate(mat4(1.0), kneeLOffset);
-	//mat4 kneeLRotZ = rotate(mat4(), radians(q[CoordinateName::KNEE_L_FLEX]), vec3(0, 0, 1));
-	//jointLocalTransformations[JointName::POINT8] = kneeLTra * kneeLRotZ;
-
-	//// left ankle joint
-	//vec3 ankleLOffset = treeJoints[9];
-	//mat4 ankleLTra = translate(mat4(1.0), ankleLOffset);
-	//mat4 ankleLRotZ = rotate(mat4(), radians(q[CoordinateName::ANKLE_L_FLEX]), vec3(0, 0, 1));
-	//mat4 talusLModelMatrix = ankleLRotZ;
-	//jointLocalTransformations[JointName::POINT9] = ankleLTra * ankleLRotZ;
-
-	//// left calcn joint
-	//vec3 calcnLOffset = vec3(-0.062, -0.053, -0.010);
-	//mat4 calcnLTra = translate(mat4(1.0), calcnLOffset);
-	//jointLocalTransformations[JointName::POINT10] = calcnLTra;
-
-	//// left mtp joint
-	//vec3 toesLOffset = vec3(0.184, -0.002, -0.001);
-	//mat4 mtpLTra = translate(mat4(1.0), toesLOffset);
-	//jointLocalTransformations[JointName::POINT11] = mtpLTra;
-
-
-	// back joint
-	vec3 backOffset = treeJoints[6];
-	mat4 lumbarTra = translate(mat4(1.0), backOffset);
-	mat4 lumbarRotX = rotate(mat4(), radians(q[CoordinateName::LUMBAR_BEND]), vec3(1, 0, 0));
-	mat4 lumbarRotY = rotate(mat4(), radians(q[CoordinateName::LUMBAR_ROT]), vec3(0, 1, 0));
-	mat4 lumbarRotZ = rotate(mat4(), radians(q[CoordinateName::LUMBAR_FLEX]), vec3(0, 0, 1));
-	jointLocalTransformations[JointName::POINT7] = lumbarTra * lumbarRotX * lumbarRotY * lumbarRotZ;
+void updateDrag(const mat4& viewMatrix) {
+	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) != GLFW_PRESS) {
+		drag.tree = -1;
+		return;
+	}
+	// the cursor is captured by the camera, aim with the center of the view
+	mat4 cameraToWorld = inverse(viewMatrix);
+	vec3 origin = vec3(cameraToWorld[3]);
+	vec3 direction = -normalize(vec3(cameraToWorld[2]));
+	if (drag.tree < 0) {
+		PickHit hit = pickTrees(origin, direction, drag.tree);
+		if (hit.bone < 0) return;
+		drag.bone = hit.bone;
+		drag.localPoint = hit.localPoint;
+		drag.distance = hit.distance;
+	}
 
-	return jointLocalTransformations;
+	// a spring from the grabbed point to where the view ray holds it
+	const TreeInstance& tree = trees[drag.tree];
+	vec3 point = vec3(tree.modelMatrix *
+		vec4(bonePalette.transformations[drag.bone].transformPoint(drag.localPoint), 1.0f));
+	applyPointForce(drag.tree, drag.bone, drag.localPoint,
+		DRAG_STIFFNESS * (origin + direction * drag.distance - point));
 }
 
-vector<mat4> calculateSkinningTransformations(map<int, float> q) {
-	auto jointLocalTransformationsBinding = calculateModelPoseFromCoordinates(bindingPose);
-	skeleton->setPose(jointLocalTransformationsBinding);
-	auto bindingWorldTransformations = skeleton->getJointWorldTransformations();
+void updateForest(const vec3& cameraPosition) {
+	if (forestStreamer == NULL) return;
+	vector<ForestTile*> loaded;
+	vector<pair<int, int>> retired;
+	forestStreamer->update(cameraPosition, loaded, retired);
+	for (const auto& coordinates : retired) {
+		for (size_t i = 0; i < residentTiles.size(); i++) {
+			if (residentTiles[i]->x != coordinates.first || residentTiles[i]->z != coordinates.second) continue;
+			delete residentTiles[i];
+			residentTiles[i] = residentTiles.back();
+			residentTiles.pop_back();
+			break;
+		}
+	}
+
+	// the species meshes, skeleton and textures are shared, a tile only adds
+	// its placements and one simulation seeded from those of its trees
+	for (ForestTile* tile : loaded) {
+		ResidentTile* resident = new ResidentTile();
+		resident->x = tile->x;
+		resident->z = tile->z;
+		uint64_t seed = SIMULATION_SEED;
+		for (const auto& instance : tile->instances) {
+			if (instance.species >= TREE_SPECIES) continue;
+			TreeInstance tree;
+			tree.modelMatrix = instance.modelMatrix();
+			tree.boundsCenter = treeBoundsCenter;
+			tree.boundsRadius = treeBoundsRadius;
+			resident->trees.push_back(tree);
+			seed = seed * 6364136223846793005ull + instance.seed;
+		}
+		resident->simulation = createSimulation(seed);
+		residentTiles.push_back(resident);
+		delete tile;
+	}
+
+	// streamed trees only sway in the wind, contacts and dragging stay with
+	// the hero trees
+	for (ResidentTile* tile : residentTiles) {
+		if (tile->trees.empty()) continue;
+		for (int i = 0; i < SIMULATION_STEPS_PER_FRAME; i++) {
+			stepSimulation(tile->simulation, dynamicsParameters);
+		}
+		updatePaletteFromSimulation(tile->simulation, tile->palette);
+	}
+}
 
-	auto jointLocalTransformationsCurrent = calculateModelPoseFromCoordinates(q);
-	skeleton->setPose(jointLocalTransformationsCurrent);
-	auto currentWorldTransformations = skeleton->getJointWorldTransformations();
+void updateSkinningTransformations(map<int, float> q, BonePalette& palette) {
+	// only the joints whose coordinates changed and their descendants
+	skeleton->setPose(calculateChangedJointTransformations(q, palette.evaluatedCoordinates));
+	updateBonePalette(palette);
+}
 
-	vector<mat4> skinningTransformations(JointName::JOINTS);
-	for (auto joint : bindingWorldTransformations) {
-		mat4 BInvWorld = glm::inverse(joint.second);
-		mat4 JWorld = currentWorldTransformations[joint.first];
-		skinningTransformations[joint.first] = JWorld * BInvWorld;
+void updateBonePalette(BonePalette& palette) {
+	const vector<int>& changed = skeleton->updateWorldTransformations();
+	if (changed.empty()) return;
+	palette.revision++;
+	for (int joint : changed) {
+		Joint* j = skeleton->joints[joint];
+		palette.transformations[joint] = j->jointWorldTransformation *
+			j->jointBindTransformation.inverse();
+		palette.matrices[joint] = palette.transformations[joint].toBoneMatrix();
+		palette.boneRevisions[joint] = palette.revision;
 	}
+}
 
-	return skinningTransformations;
+void updatePaletteFromSimulation(const SimulationState& state, BonePalette& palette) {
+	// for poses other than the skeleton's, every bone is evaluated again
+	vector<RigidTransform> world;
+	calculateJointWorldTransformations(state, world);
+	palette.revision++;
+	for (const auto& joint : skeleton->joints) {
+		palette.transformations[joint.first] = world[joint.first] * bindInverses[joint.first];
+		palette.matrices[joint.first] = palette.transformations[joint.first].toBoneMatrix();
+		palette.boneRevisions[joint.first] = palette.revision;
+	}
 }
 
-vector<float> calculateSkinningIndices() {
+vector<float> calculateSkinningIndices(const vector<vec3>& vertices) {
 	// Task 4.3: assign a body index for each vertex in the model (skin) based
 	// on its proximity to a body part (e.g. tight)
 	vector<float> indices;
-	for (auto v : skeletonSkin->indexedVertices) {
+	for (auto v : vertices) {
 		// dummy
 		//indices.push_back(1.0);
 		if (v.y <= 2.5) {
@@ -452,12 +5342,96 @@ vector<float> calculateSkinningIndices() {
 }
 
 
+Skeleton* createTreeSkeleton()
+{
+	Skeleton* skeleton = new Skeleton(modelMatrixLocation, viewMatrixLocation, projectionMatrixLocation);
+	// joints, bodies and drawables all live in the skeleton's arena
+	TreeArena& arena = skeleton->arena;
+	// pelvis
+	Joint* baseJoint = arena.create<Joint>(); // creates a joint
+	baseJoint->parent = NULL; // assigns the parent joint (NULL -> no parent)
+	skeleton->joints[JointName::ROOT] = baseJoint; // adds the joint in the skeleton's dictionary
+
+	Body* pelvisBody = arena.create<Body>(arena); // creates a body
+	pelvisBody->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 0, 0), vec3(0, 0.5, 0) }));
+	pelvisBody->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 0.5, 0), vec3(0, 1, 0) }));
+	pelvisBody->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 1, 0), vec3(0, 1.5, 0) }));
+	pelvisBody->joint = baseJoint; // relates to a joint
+	skeleton->bodies[BodyName::BONE1] = pelvisBody; // adds the body in the skeleton's dictionary
+
+													// right femur
+	Joint* hipR = arena.create<Joint>();
+	hipR->parent = baseJoint;
+	skeleton->joints[JointName::POINT2] = hipR;
+
+	Body* femurR = arena.create<Body>(arena);
+	femurR->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 0, 0), vec3(0, 0.5, 0) }));
+	femurR->joint = hipR;
+	skeleton->bodies[BodyName::BONE3] = femurR;
+
+	// right tibia
+	Joint* kneeR = arena.create<Joint>();
+	kneeR->parent = hipR;
+	skeleton->joints[JointName::POINT3] = kneeR;
+
+	Body* tibiaR = arena.create<Body>(arena);
+	tibiaR->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 0.5, 0), vec3(0, 1, 0) }));
+	tibiaR->joint = kneeR;
+	skeleton->bodies[BodyName::BONE4] = tibiaR;
+
+	// right talus
+	Joint* ankleR = arena.create<Joint>();
+	ankleR->parent = kneeR;
+	skeleton->joints[JointName::POINT4] = ankleR;
+
+	Body* talusR = arena.create<Body>(arena);
+	talusR->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 1, 0), vec3(0, 1.5, 0) }));
+	talusR->joint = ankleR;
+	skeleton->bodies[BodyName::BONE5] = talusR;
+
+	// right calcn
+	Joint* subtalarR = arena.create<Joint>();
+	subtalarR->parent = ankleR;
+	skeleton->joints[JointName::POINT5] = subtalarR;
+
+	Body* calcnR = arena.create<Body>(arena);
+	calcnR->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 1.5, 0), vec3(0, 2, 0) }));
+	calcnR->joint = subtalarR;
+	skeleton->bodies[BodyName::BONE6] = calcnR;
+
+	// toes
+	Joint* mtpR = arena.create<Joint>();
+	mtpR->parent = subtalarR;
+	skeleton->joints[JointName::POINT6] = mtpR;
+
+	Body* toesR = arena.create<Body>(arena);
+	toesR->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 2, 0), vec3(0, 2.5, 0) }));
+	toesR->joint = mtpR;
+	skeleton->bodies[BodyName::BONE7] = toesR;
+
+	// torso
+	Joint* back = arena.create<Joint>();
+	back->parent = baseJoint;
+	skeleton->joints[JointName::POINT7] = back;
+
+	Body* torso = arena.create<Body>(arena);
+	torso->drawables.push_back(arena.create<Drawable>(vector<vec3>{ vec3(0, 2.5, 0), vec3(0, 3, 0) }));
+	torso->joint = back;
+	skeleton->bodies[BodyName::BONE8] = torso;
+
+	skeleton->setBindingPose(calculateModelPoseFromCoordinates(bindingPose));
+
+	return skeleton;
+}
+
 void createContext()
 {
-	// Create and compile our GLSL program from the shaders
-	shaderProgram = loadShaders(
-		"StandardShading.vertexshader",
-		"StandardShading.fragmentshader");
+	// the variants are compiled from these on first use (or come from the
+	// program binary cache)
+	vertexShaderSource = readTextFile("StandardShading.vertexshader");
+	fragmentShaderSource = readTextFile("StandardShading.fragmentshader");
+	// static and untextured, the skeleton keeps these M, V, P locations
+	useShaderVariant(0);
 
 	// load obj
 	loadOBJWithTiny("MapleTreeStem.obj", objVerticestree, objUVstree, objNormalstree);
@@ -468,31 +5442,10 @@ void createContext()
 	defineJointPoints();
 
 	// Task 6.2: load diffuse and specular texture maps
-	diffuseTexturetree = loadSOIL("maple_bark.png");
-	specularTexturetree = loadSOIL("MapleTree_specular.bmp");
-	diffuseTextureleaves = loadSOIL("leaf.png");
-	specularTextureleaves = loadSOIL("MapleTree_specular.bmp");
-
-	// Task 6.3: get a pointer to the texture samplers (diffuseColorSampler, specularColorSampler)
-	diffuceColorSampler = glGetUniformLocation(shaderProgram, "diffuceColorSampler");
-	specularColorSampler = glGetUniformLocation(shaderProgram, "specularColorSampler");
-
-	// get pointers to the uniform variables
-	modelMatrixLocation = glGetUniformLocation(shaderProgram, "M");
-	viewMatrixLocation = glGetUniformLocation(shaderProgram, "V");
-	projectionMatrixLocation = glGetUniformLocation(shaderProgram, "P");
-	KaLocation = glGetUniformLocation(shaderProgram, "mtl.Ka");
-	KdLocation = glGetUniformLocation(shaderProgram, "mtl.Kd");
-	KsLocation = glGetUniformLocation(shaderProgram, "mtl.Ks");
-	NsLocation = glGetUniformLocation(shaderProgram, "mtl.Ns");
-	LaLocation = glGetUniformLocation(shaderProgram, "light.La");
-	LdLocation = glGetUniformLocation(shaderProgram, "light.Ld");
-	LsLocation = glGetUniformLocation(shaderProgram, "light.Ls");
-	lightPositionLocation = glGetUniformLocation(shaderProgram, "light.lightPosition_worldspace");
-	lightPowerLocation = glGetUniformLocation(shaderProgram, "light.power");
-	useSkinningLocation = glGetUniformLocation(shaderProgram, "useSkinning");
-	boneTransformationsLocation = glGetUniformLocation(shaderProgram, "boneTransformations");
-	planeLocation = glGetUniformLocation(shaderProgram, "planeCoeffs");
+	diffuseTexturetree = loadTexture("maple_bark.png");
+	specularTexturetree = loadTexture("MapleTree_specular.bmp");
+	diffuseTextureleaves = loadTexture("leaf.png");
+	specularTextureleaves = loadTexture("MapleTree_specular.bmp");
 
 	vector<vec3> segmentVertices = {
 		vec3(0.0f, 0.0f, 0.0f),
@@ -536,148 +5489,597 @@ void createContext()
 
 
 
-	skeleton = new Skeleton(modelMatrixLocation, viewMatrixLocation, projectionMatrixLocation);
+	skeleton = createTreeSkeleton();
+	simulation = createSimulation(SIMULATION_SEED);
 
+	skeletonSkin = new Drawable("MapleTreeStem.obj");
+	auto maleBoneIndices = calculateSkinningIndices(skeletonSkin->indexedVertices);
+	glGenBuffers(1, &maleBoneIndicesVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, maleBoneIndicesVBO);
+	glBufferData(GL_ARRAY_BUFFER, maleBoneIndices.size() * sizeof(float),
+		&maleBoneIndices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(3);
 
-	// pelvis
-	Joint* baseJoint = new Joint(); // creates a joint
-	baseJoint->parent = NULL; // assigns the parent joint (NULL -> no parent)
-	skeleton->joints[JointName::ROOT] = baseJoint; // adds the joint in the skeleton's dictionary
+	// trunk bounds per bone at the binding pose, refit every frame for culling
+	trunkBoneBounds.assign(JointName::JOINTS, AABB{ vec3(FLT_MAX), vec3(-FLT_MAX) });
+	for (size_t i = 0; i < maleBoneIndices.size(); i++) {
+		trunkBoneBounds[(int)maleBoneIndices[i]].expand(skeletonSkin->indexedVertices[i]);
+	}
+	createBoneCapsules();
+	pickingBVH.build(boneCapsules, skeletonSkin->indexedVertices, maleBoneIndices,
+		skeletonSkin->indices);
 
-	Body* pelvisBody = new Body(); // creates a body
-	pelvisBody->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 0, 0), vec3(0, 0.5, 0) }));
-	pelvisBody->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 0.5, 0), vec3(0, 1, 0) }));
-	pelvisBody->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 1, 0), vec3(0, 1.5, 0) }));
-	pelvisBody->joint = baseJoint; // relates to a joint
-	skeleton->bodies[BodyName::BONE1] = pelvisBody; // adds the body in the skeleton's dictionary
+	// obj
+	// Task 6.1: bind object vertex positions to attribute 0, UV coordinates
+	// to attribute 1 and normals to attribute 2
+	//*/
+	//   glGenVertexArrays(1, &treeVAO);
+	//   glBindVertexArray(treeVAO);
 
-													// right femur
-	Joint* hipR = new Joint();
-	hipR->parent = baseJoint;
-	skeleton->joints[JointName::POINT2] = hipR;
+	//   // vertex VBO
+	//   glGenBuffers(1, &treeVerticiesVBO);
+	//   glBindBuffer(GL_ARRAY_BUFFER, treeVerticiesVBO);
+	//   glBufferData(GL_ARRAY_BUFFER, objVerticestree.size() * sizeof(glm::vec3),
+	//       &objVerticestree[0], GL_STATIC_DRAW);
+	//   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	//   glEnableVertexAttribArray(0);
 
-	Body* femurR = new Body();
-	femurR->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 0, 0), vec3(0, 0.5, 0) }));
-	femurR->joint = hipR;
-	skeleton->bodies[BodyName::BONE3] = femurR;
+	////normals VBO
+	//   glGenBuffers(1, &treeNormalsVBO);
+	//   glBindBuffer(GL_ARRAY_BUFFER, treeNormalsVBO);
+	//   glBufferData(GL_ARRAY_BUFFER, objNormalstree.size() * sizeof(glm::vec3),
+	//       &objNormalstree[0], GL_STATIC_DRAW);
+	//   glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	//   glEnableVertexAttribArray(1);
 
-	// right tibia
-	Joint* kneeR = new Joint();
-	kneeR->parent = hipR;
-	skeleton->joints[JointName::POINT3] = kneeR;
+	//   // uvs VBO
+	//   glGenBuffers(1, &treeUVVBO);
+	//   glBindBuffer(GL_ARRAY_BUFFER, treeUVVBO);
+	//   glBufferData(GL_ARRAY_BUFFER, objUVstree.size() * sizeof(glm::vec2),
+	//       &objUVstree[0], GL_STATIC_DRAW);
+	//   glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	//   glEnableVertexAttribArray(2);
+	//*/
 
-	Body* tibiaR = new Body();
-	tibiaR->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 0.5, 0), vec3(0, 1, 0) }));
-	tibiaR->joint = kneeR;
-	skeleton->bodies[BodyName::BONE4] = tibiaR;
+	// leaves hang from the same bones as the trunk and are grouped in clusters
+	// that can be culled individually
+	auto leavesBoneIndices = calculateSkinningIndices(objVerticesleaves);
+	leafClusters = buildLeafClusters(objVerticesleaves, objNormalsleaves, objUVsleaves,
+		leavesBoneIndices, 2.0f);
+	for (size_t c = 0; c < leafClusters.size(); c++) {
+		for (GLint v = leafClusters[c].first; v < leafClusters[c].first + leafClusters[c].count; v += 3) {
+			leafCentroids.push_back((objVerticesleaves[v] + objVerticesleaves[v + 1] +
+				objVerticesleaves[v + 2]) / 3.0f);
+			leafTriangleBones.push_back(leafClusters[c].bone);
+			leafTriangleClusters.push_back((int)c);
+		}
+	}
+	threadPool = new ThreadPool();
 
-	// right talus
-	Joint* ankleR = new Joint();
-	ankleR->parent = kneeR;
-	skeleton->joints[JointName::POINT4] = ankleR;
+	glGenVertexArrays(1, &leavesVAO);
+	glBindVertexArray(leavesVAO);
 
-	Body* talusR = new Body();
-	talusR->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 1, 0), vec3(0, 1.5, 0) }));
-	talusR->joint = ankleR;
-	skeleton->bodies[BodyName::BONE5] = talusR;
+	// vertex VBO
+	glGenBuffers(1, &leavesVerticiesVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, leavesVerticiesVBO);
+	glBufferData(GL_ARRAY_BUFFER, objVerticesleaves.size() * sizeof(glm::vec3),
+		&objVerticesleaves[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(0);
 
-	// right calcn
-	Joint* subtalarR = new Joint();
-	subtalarR->parent = ankleR;
-	skeleton->joints[JointName::POINT5] = subtalarR;
+	//normals VBO
+	glGenBuffers(1, &leavesNormalsVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, leavesNormalsVBO);
+	glBufferData(GL_ARRAY_BUFFER, objNormalsleaves.size() * sizeof(glm::vec3),
+		&objNormalsleaves[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(1);
 
-	Body* calcnR = new Body();
-	calcnR->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 1.5, 0), vec3(0, 2, 0) }));
-	calcnR->joint = subtalarR;
-	skeleton->bodies[BodyName::BONE6] = calcnR;
+	// uvs VBO
+	glGenBuffers(1, &leavesUVVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, leavesUVVBO);
+	glBufferData(GL_ARRAY_BUFFER, objUVsleaves.size() * sizeof(glm::vec2),
+		&objUVsleaves[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(2);
 
-	// toes
-	Joint* mtpR = new Joint();
-	mtpR->parent = subtalarR;
-	skeleton->joints[JointName::POINT6] = mtpR;
+	// bone indices VBO
+	glGenBuffers(1, &leavesBoneIndicesVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, leavesBoneIndicesVBO);
+	glBufferData(GL_ARRAY_BUFFER, leavesBoneIndices.size() * sizeof(float),
+		&leavesBoneIndices[0], GL_STATIC_DRAW);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(3);
 
-	Body* toesR = new Body();
-	toesR->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 2, 0), vec3(0, 2.5, 0) }));
-	toesR->joint = mtpR;
-	skeleton->bodies[BodyName::BONE7] = toesR;
+	// depth sorted indices, rewritten every frame
+	glGenBuffers(1, &leavesElementVBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, leavesElementVBO);
+
+	// feedback buffers for the full detail meshes, sharing their indices
+	trunkSkin = new SkinnedMesh(skeletonSkin->VAO,
+		(GLsizei)skeletonSkin->indexedVertices.size(), skeletonSkin->elementVBO);
+	leavesSkin = new SkinnedMesh(leavesVAO, (GLsizei)objVerticesleaves.size(), leavesElementVBO);
+	createShadowMap();
+
+	// precompute the levels of detail and place the hero tree
+	createLODLevels();
+	TreeInstance hero;
+	hero.modelMatrix = glm::mat4(1.0) * translate(mat4(), vec3(0, 0, 0)) *
+		glm::scale(mat4(), vec3(0.1, 0.1, 0.1));
+	vec3 boundsMin = objVerticestree[0], boundsMax = objVerticestree[0];
+	for (auto& v : objVerticestree) { boundsMin = min(boundsMin, v); boundsMax = max(boundsMax, v); }
+	for (auto& v : objVerticesleaves) { boundsMin = min(boundsMin, v); boundsMax = max(boundsMax, v); }
+	treeBoundsCenter = (boundsMin + boundsMax) * 0.5f;
+	treeBoundsRadius = length(boundsMax - boundsMin) * 0.5f;
+	hero.boundsCenter = treeBoundsCenter;
+	hero.boundsRadius = treeBoundsRadius;
+	trees.push_back(hero);
+}
 
-	// torso
-	Joint* back = new Joint();
-	back->parent = baseJoint;
-	skeleton->joints[JointName::POINT7] = back;
+void createLODLevels()
+{
+	// joint hierarchy and bone lengths at the binding pose
+	map<int, int> parents;
+	for (auto& joint : skeleton->joints) {
+		parents[joint.first] = -1;
+		for (auto& other : skeleton->joints) {
+			if (other.second == joint.second->parent) parents[joint.first] = other.first;
+		}
+	}
+	auto bindLocal = calculateModelPoseFromCoordinates(bindingPose);
+	auto boneIndices = calculateSkinningIndices(skeletonSkin->indexedVertices);
+
+	// screen size thresholds, trunk triangle ratio and twig length per level
+	const float minScreenSize[LOD_LEVELS] = { 0.5f, 0.2f, 0.05f, 0.0f };
+	const float trunkRatio[LOD_LEVELS] = { 1.0f, 0.5f, 0.15f, 0.0f };
+	const float minBoneLength[LOD_LEVELS] = { 0.0f, 0.0f, 0.6f, 0.0f };
+
+	lodLevels.resize(LOD_LEVELS);
+	for (int level = 0; level < LOD_LEVELS; level++) {
+		LODLevel& lod = lodLevels[level];
+		lod.minScreenSize = minScreenSize[level];
+		lod.jointRemap = collapseShortBones(bindLocal, parents, JointName::JOINTS,
+			minBoneLength[level]);
+		if (level == 0 || level == LOD_LEVELS - 1) continue;
+
+		// trunk: skin the collapsed twigs with their parents, then decimate
+		vector<float> remappedIndices(boneIndices.size());
+		for (size_t i = 0; i < boneIndices.size(); i++) {
+			remappedIndices[i] = (float)lod.jointRemap[(int)boneIndices[i]];
+		}
+		vector<vec3> vertices, normals;
+		vector<vec2> uvs;
+		vector<float> bones;
+		vector<unsigned int> indices;
+		decimateMesh(skeletonSkin->indexedVertices, skeletonSkin->indexedNormals,
+			skeletonSkin->indexedUVS, remappedIndices, skeletonSkin->indices,
+			trunkRatio[level], vertices, normals, uvs, bones, indices);
+		lod.trunk = new LODMesh(vertices, normals, uvs, bones, indices);
+	}
 
-	Body* torso = new Body();
-	torso->drawables.push_back(new Drawable(vector<vec3>{ vec3(0, 2.5, 0), vec3(0, 3, 0) }));
-	torso->joint = back;
-	skeleton->bodies[BodyName::BONE8] = torso;
+	// leaf cards replace the individual leaves at level 2
+	vector<vec3> cardVertices, cardNormals;
+	vector<vec2> cardUVs;
+	buildLeafCards(objVerticesleaves, 2.0f, cardVertices, cardNormals, cardUVs);
+	vector<float> cardBones(cardVertices.size(), (float)JointName::ROOT);
+	vector<unsigned int> cardIndices(cardVertices.size());
+	for (size_t i = 0; i < cardIndices.size(); i++) cardIndices[i] = (unsigned int)i;
+	lodLevels[2].leaves = new LODMesh(cardVertices, cardNormals, cardUVs, cardBones, cardIndices);
+
+	// the last level is a baked impostor
+	lodLevels[LOD_LEVELS - 1].leaves = bakeImpostor();
+}
+
+LODMesh* bakeImpostor()
+{
+	// model space bounds of the whole tree
+	vec3 boundsMin = objVerticestree[0], boundsMax = objVerticestree[0];
+	for (auto& v : objVerticestree) { boundsMin = min(boundsMin, v); boundsMax = max(boundsMax, v); }
+	for (auto& v : objVerticesleaves) { boundsMin = min(boundsMin, v); boundsMax = max(boundsMax, v); }
+	vec3 center = (boundsMin + boundsMax) * 0.5f;
+	float halfWidth = std::max(boundsMax.x - boundsMin.x, boundsMax.z - boundsMin.z) * 0.5f;
+	float halfHeight = (boundsMax.y - boundsMin.y) * 0.5f;
+
+	glGenTextures(1, &impostorTexture);
+	glBindTexture(GL_TEXTURE_2D, impostorTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glGenRenderbuffers(1, &impostorDepthRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, impostorDepthRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT);
+
+	glGenFramebuffers(1, &impostorFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, impostorFBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostorTexture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, impostorDepthRBO);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		throw runtime_error("Impostor framebuffer is incomplete\n");
+	}
+
+	// render the full tree at the binding pose from the side
+	glViewport(0, 0, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	BonePalette bindPalette;
+	skinTrees(bindPalette);
+	PassState pass;
+	pass.pass = MAIN_PASS;
+	pass.viewMatrix = lookAt(center + vec3(0, 0, 2 * halfWidth + 1), center, vec3(0, 1, 0));
+	pass.projectionMatrix = ortho(-halfWidth, halfWidth, -halfHeight, halfHeight,
+		0.1f, 4 * halfWidth + 2);
+	pass.shadowed = false;
+	pass.palette = &bindPalette;
+	TreeInstance full;
+	full.lodLevel = 0;
+	for (unsigned int i = 0; i < objVerticesleaves.size(); i++) full.leafIndices.push_back(i);
+	drawTree(full, pass);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, frameFBO);
+	glViewport(0, 0, viewportWidth, viewportHeight);
+	glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
+
+	// two crossed quads covering the tree bounds
+	vector<vec3> vertices, normals;
+	vector<vec2> uvs;
+	vec3 axes[2] = { vec3(1, 0, 0), vec3(0, 0, 1) };
+	for (int a = 0; a < 2; a++) {
+		vec3 u = axes[a] * halfWidth, v = vec3(0, halfHeight, 0);
+		vec3 quad[4] = { center - u - v, center + u - v, center + u + v, center - u + v };
+		vec2 quadUV[4] = { vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 1) };
+		for (int k = 0; k < 4; k++) {
+			vertices.push_back(quad[k]);
+			normals.push_back(cross(axes[a], vec3(0, 1, 0)));
+			uvs.push_back(quadUV[k]);
+		}
+	}
+	vector<float> bones(vertices.size(), (float)JointName::ROOT);
+	vector<unsigned int> indices = { 0, 1, 2, 0, 2, 3, 4, 5, 6, 4, 6, 7 };
+	return new LODMesh(vertices, normals, uvs, bones, indices);
+}
+
+void drawTree(const TreeInstance& tree, const PassState& pass)
+{
+	// full detail draws the meshes skinned this frame (see skinTrees) when
+	// they hold the tree's pose, everything else skins in the vertex shader
+	// the impostor quads would cast solid rectangles and shadow each other,
+	// far trees cast no shadow
+	if (pass.pass == SHADOW_PASS && tree.lodLevel == LOD_LEVELS - 1) return;
+	const LODLevel& lod = lodLevels[tree.lodLevel];
+	bool textured = pass.pass == MAIN_PASS;
+	bool preskinned = lod.trunk == NULL && pass.palette->id == skinnedPaletteId &&
+		pass.palette->revision == skinnedPaletteRevision;
+
+	// trunk, the impostor carries both the trunk and the leaves
+	if (tree.lodLevel != LOD_LEVELS - 1) {
+		usePassVariant(preskinned ? 0 : SHADER_SKINNING, pass);
+		glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &tree.modelMatrix[0][0]);
+		if (textured) {
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, diffuseTexturetree);
+			glUniform1i(diffuceColorSampler, 0);
+
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, specularTexturetree);
+			glUniform1i(specularColorSampler, 1);
+		}
+
+		if (preskinned) {
+			trunkSkin->bind();
+			glDrawElements(GL_TRIANGLES, (GLsizei)skeletonSkin->indices.size(), GL_UNSIGNED_INT, NULL);
+		}
+		else if (lod.trunk == NULL) {
+			skeletonSkin->bind();
+			skeletonSkin->draw();
+		}
+		else {
+			lod.trunk->bind();
+			lod.trunk->draw();
+		}
+	}
+
+	// leaves are blended, they stay out of the depth prepass
+	if (pass.pass == DEPTH_PASS) return;
+	usePassVariant(preskinned ? 0 : SHADER_SKINNING, pass);
+	glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &tree.modelMatrix[0][0]);
+
+	// Task 6.4: bind textures and transmit diffuse and specular maps to the GPU
+	if (textured) {
+		glActiveTexture(GL_TEXTURE0);
+		if (tree.lodLevel == LOD_LEVELS - 1) {
+			glBindTexture(GL_TEXTURE_2D, impostorTexture);
+		}
+		else {
+			glBindTexture(GL_TEXTURE_2D, (window == NULL || glfwGetKey(window, GLFW_KEY_SPACE) != GLFW_PRESS) ? diffuseTextureleaves : diffuseTexturetree); //dokimh ths glfwGetKey
+		}
+		glUniform1i(diffuceColorSampler, 0);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, specularTextureleaves);
+		glUniform1i(specularColorSampler, 1);
+	}
+
+	if (lod.leaves == NULL) {
+		// visible clusters only, back to front; the shadow map needs every
+		// cluster and no order
+		if (preskinned) leavesSkin->bind();
+		else glBindVertexArray(leavesVAO);
+		if (pass.pass == SHADOW_PASS) {
+			glDrawArrays(GL_TRIANGLES, 0, leavesSkin->vertexCount);
+		}
+		else if (!tree.leafIndices.empty()) {
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, tree.leafIndices.size() * sizeof(unsigned int),
+				&tree.leafIndices[0], GL_STREAM_DRAW);
+			glDrawElements(GL_TRIANGLES, (GLsizei)tree.leafIndices.size(), GL_UNSIGNED_INT, NULL);
+		}
+	}
+	else {
+		lod.leaves->bind();
+		lod.leaves->draw();
+	}
+}
+
+void usePassVariant(unsigned int variant, const PassState& pass)
+{
+	// only the main pass shades, the others write depth
+	if (pass.pass == MAIN_PASS) {
+		variant |= SHADER_TEXTURED;
+		if (pass.shadowed) variant |= SHADER_SHADOWED;
+	}
+	useShaderVariant(variant);
+	glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &pass.viewMatrix[0][0]);
+	glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &pass.projectionMatrix[0][0]);
+	if (variant & SHADER_SHADOWED) {
+		glUniformMatrix4fv(currentProgram->lightVP, 1, GL_FALSE, &pass.lightViewProjection[0][0]);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, shadowMapTexture);
+		glUniform1i(currentProgram->shadowMapSampler, 2);
+	}
+	if (variant & SHADER_SKINNING) uploadBonePalette(*pass.palette);
+}
+
+void skinTrees(BonePalette& palette)
+{
+	// nothing is rasterized, the deformed vertices land in the feedback buffers
+	useShaderVariant(SHADER_SKINNING | SHADER_FEEDBACK);
+	uploadBonePalette(palette);
+	glEnable(GL_RASTERIZER_DISCARD);
+	trunkSkin->skin();
+	leavesSkin->skin();
+	glDisable(GL_RASTERIZER_DISCARD);
+	skinnedPaletteId = palette.id;
+	skinnedPaletteRevision = palette.revision;
+}
+
+void createShadowMap()
+{
+	glGenTextures(1, &shadowMapTexture);
+	glBindTexture(GL_TEXTURE_2D, shadowMapTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0,
+		GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	// hardware comparison, linear filtering gives 2x2 pcf
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	// everything outside the map is lit
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	GLfloat border[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+
+	glGenFramebuffers(1, &shadowMapFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowMapTexture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		throw runtime_error("Shadow map framebuffer not complete.\n");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	skeletonSkin = new Drawable("MapleTreeStem.obj");
-	auto maleBoneIndices = calculateSkinningIndices();
-	glGenBuffers(1, &maleBoneIndicesVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, maleBoneIndicesVBO);
-	glBufferData(GL_ARRAY_BUFFER, maleBoneIndices.size() * sizeof(float),
-		&maleBoneIndices[0], GL_STATIC_DRAW);
-	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(3);
+mat4 calculateLightViewProjection()
+{
+	// orthographic, looking from the light at the middle of the hero trees and
+	// just wide enough to hold all of them; the streamed tiles would spread
+	// the map over the whole streamed area
+	AABB bounds{ vec3(FLT_MAX), vec3(-FLT_MAX) };
+	for (auto& tree : trees) {
+		vec3 center = vec3(tree.modelMatrix * vec4(tree.boundsCenter, 1.0f));
+		float radius = tree.boundsRadius * length(vec3(tree.modelMatrix[0]));
+		bounds.expand(center - vec3(radius));
+		bounds.expand(center + vec3(radius));
+	}
+	vec3 center = (bounds.min + bounds.max) * 0.5f;
+	float radius = length(bounds.max - bounds.min) * 0.5f;
+	vec3 direction = normalize(light.lightPosition_worldspace - center);
+	mat4 view = lookAt(center + direction * (2.0f * radius), center, vec3(0, 1, 0));
+	return ortho(-radius, radius, -radius, radius, radius, 3.0f * radius) * view;
+}
 
-	// obj
-	// Task 6.1: bind object vertex positions to attribute 0, UV coordinates
-	// to attribute 1 and normals to attribute 2
-	//*/
-	//   glGenVertexArrays(1, &treeVAO);
-	//   glBindVertexArray(treeVAO);
+vector<TreeGroup> treeGroups()
+{
+	vector<TreeGroup> groups;
+	groups.push_back(TreeGroup{ &trees, &bonePalette });
+	for (ResidentTile* tile : residentTiles) {
+		if (!tile->trees.empty()) groups.push_back(TreeGroup{ &tile->trees, &tile->palette });
+	}
+	return groups;
+}
 
-	//   // vertex VBO
-	//   glGenBuffers(1, &treeVerticiesVBO);
-	//   glBindBuffer(GL_ARRAY_BUFFER, treeVerticiesVBO);
-	//   glBufferData(GL_ARRAY_BUFFER, objVerticestree.size() * sizeof(glm::vec3),
-	//       &objVerticestree[0], GL_STATIC_DRAW);
-	//   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	//   glEnableVertexAttribArray(0);
+void renderTrees(const vector<TreeGroup>& groups, const mat4& viewMatrix, const mat4& projectionMatrix,
+	const mat4& lightViewProjection)
+{
+	// expects the levels, visibility and leaf order of the trees to be current;
+	// only the hero pose is worth skinning once for all passes, the streamed
+	// tiles are mostly far away and each has a pose of its own
+	bool fullDetail = false;
+	for (auto& tree : trees) fullDetail |= tree.visible && tree.lodLevel == 0;
+	if (fullDetail) skinTrees(bonePalette);
+
+	PassState pass;
+	pass.shadowed = true;
+	pass.lightViewProjection = lightViewProjection;
+
+	// shadow map, always filled with every caster in the light frustum, so
+	// shadows do not depend on where the camera looks
+	GLint polygonMode[2];
+	glGetIntegerv(GL_POLYGON_MODE, polygonMode);
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
+	glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0f, 4.0f);
+	pass.pass = SHADOW_PASS;
+	pass.viewMatrix = mat4();
+	pass.projectionMatrix = pass.lightViewProjection;
+	drawTreeGroups(groups, pass);
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glPolygonMode(GL_FRONT_AND_BACK, polygonMode[0]);
+	glBindFramebuffer(GL_FRAMEBUFFER, frameFBO);
+	glViewport(0, 0, viewportWidth, viewportHeight);
+
+	// depth of the opaque trunks first, the main pass then shades each pixel once
+	pass.pass = DEPTH_PASS;
+	pass.viewMatrix = viewMatrix;
+	pass.projectionMatrix = projectionMatrix;
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	drawTreeGroups(groups, pass);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+	pass.pass = MAIN_PASS;
+	glDepthFunc(GL_LEQUAL);
+	drawTreeGroups(groups, pass);
+	glDepthFunc(GL_LESS);
+}
 
-	////normals VBO
-	//   glGenBuffers(1, &treeNormalsVBO);
-	//   glBindBuffer(GL_ARRAY_BUFFER, treeNormalsVBO);
-	//   glBufferData(GL_ARRAY_BUFFER, objNormalstree.size() * sizeof(glm::vec3),
-	//       &objNormalstree[0], GL_STATIC_DRAW);
-	//   glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	//   glEnableVertexAttribArray(1);
+void drawTreeGroups(const vector<TreeGroup>& groups, PassState& pass)
+{
+	for (const auto& group : groups) {
+		pass.palette = group.palette;
+		for (const auto& tree : *group.trees) {
+			if (pass.pass == SHADOW_PASS ? tree.shadowCaster : tree.visible) drawTree(tree, pass);
+		}
+	}
+}
 
-	//   // uvs VBO
-	//   glGenBuffers(1, &treeUVVBO);
-	//   glBindBuffer(GL_ARRAY_BUFFER, treeUVVBO);
-	//   glBufferData(GL_ARRAY_BUFFER, objUVstree.size() * sizeof(glm::vec2),
-	//       &objUVstree[0], GL_STATIC_DRAW);
-	//   glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-	//   glEnableVertexAttribArray(2);
-	//*/
+void cullTrees(vector<TreeInstance>& instances, const vector<RigidTransform>& T,
+	const mat4& viewMatrix, const mat4& projectionMatrix, const mat4& lightViewProjection)
+{
+	// refit the model space bounds to the current pose
+	AABB treeBounds{ vec3(FLT_MAX), vec3(-FLT_MAX) };
+	for (int bone = 0; bone < (int)trunkBoneBounds.size(); bone++) {
+		if (trunkBoneBounds[bone].min.x > trunkBoneBounds[bone].max.x) continue;
+		treeBounds.expand(transformAABB(trunkBoneBounds[bone], T[bone].toMat4()));
+	}
+	BoundingSpheres clusterSpheres;
+	clusterSpheres.resize(leafClusters.size());
+	for (size_t i = 0; i < leafClusters.size(); i++) {
+		AABB bounds = transformAABB(leafClusters[i].bindBounds, T[leafClusters[i].bone].toMat4());
+		clusterSpheres.set(i, bounds);
+		treeBounds.expand(bounds);
+	}
 
-	glGenVertexArrays(1, &leavesVAO);
-	glBindVertexArray(leavesVAO);
+	// whole trees against the world space frustum
+	Frustum frustum = extractFrustum(projectionMatrix * viewMatrix);
+	BoundingSpheres treeSpheres;
+	treeSpheres.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); i++) {
+		treeSpheres.set(i, transformAABB(treeBounds, instances[i].modelMatrix));
+	}
+	vector<unsigned char> visible, casting;
+	cullSpheres(frustum, treeSpheres, visible);
+	cullSpheres(extractFrustum(lightViewProjection), treeSpheres, casting);
+
+	for (size_t i = 0; i < instances.size(); i++) {
+		TreeInstance& tree = instances[i];
+		tree.visible = visible[i] != 0;
+		tree.shadowCaster = casting[i] != 0;
+		if (!tree.visible || lodLevels[tree.lodLevel].leaves != NULL) continue;
+
+		// leaf clusters are tested in model space, so the cluster spheres are
+		// shared by every instance
+		cullSpheres(extractFrustum(projectionMatrix * viewMatrix * tree.modelMatrix),
+			clusterSpheres, tree.leafClusterVisible);
+	}
+}
 
-	// vertex VBO
-	glGenBuffers(1, &leavesVerticiesVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, leavesVerticiesVBO);
-	glBufferData(GL_ARRAY_BUFFER, objVerticesleaves.size() * sizeof(glm::vec3),
-		&objVerticesleaves[0], GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(0);
+void sortLeaves(vector<TreeInstance>& instances, const vector<RigidTransform>& T, const mat4& viewMatrix)
+{
+	for (auto& tree : instances) {
+		if (!tree.visible || lodLevels[tree.lodLevel].leaves != NULL) continue;
+
+		// view depth row of every bone
+		vector<vec4> depthRows(T.size());
+		for (size_t bone = 0; bone < T.size(); bone++) {
+			mat4 m = viewMatrix * tree.modelMatrix * T[bone].toMat4();
+			depthRows[bone] = vec4(m[0][2], m[1][2], m[2][2], m[3][2]);
+		}
+		sortLeavesBackToFront(*threadPool, leafCentroids, leafTriangleBones, depthRows,
+			tree.leafOrder, leafSortScratch);
+		writeLeafIndices(*threadPool, tree.leafOrder, leafTriangleClusters,
+			tree.leafClusterVisible, tree.leafIndices, leafSortScratch);
+	}
+}
 
-	//normals VBO
-	glGenBuffers(1, &leavesNormalsVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, leavesNormalsVBO);
-	glBufferData(GL_ARRAY_BUFFER, objNormalsleaves.size() * sizeof(glm::vec3),
-		&objNormalsleaves[0], GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(1);
+void uploadBonePalette(BonePalette& palette)
+{
+	// 3x4 rows, 48 bytes per bone instead of 64, and only the range changed
+	// since the bound program got this palette
+	ShaderProgram& program = *currentProgram;
+	int begin = JointName::JOINTS, end = 0;
+	for (int i = 0; i < JointName::JOINTS; i++) {
+		if (program.paletteId != palette.id ||
+			palette.boneRevisions[i] > program.paletteRevision) {
+			begin = std::min(begin, i);
+			end = i + 1;
+		}
+	}
+	program.paletteId = palette.id;
+	program.paletteRevision = palette.revision;
+	if (begin >= end) return;
+	glUniformMatrix3x4fv(boneTransformationLocations[begin], end - begin, GL_FALSE,
+		&palette.matrices[begin].rows[0][0]);
+}
 
-	// uvs VBO
-	glGenBuffers(1, &leavesUVVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, leavesUVVBO);
-	glBufferData(GL_ARRAY_BUFFER, objUVsleaves.size() * sizeof(glm::vec2),
-		&objUVsleaves[0], GL_STATIC_DRAW);
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(2);
+void useShaderVariant(unsigned int variant)
+{
+	ShaderProgram& program = shaderVariants[variant];
+	if (program.program == 0) {
+		program = loadShaderVariant(vertexShaderSource, fragmentShaderSource, variant,
+			"StandardShading.");
+	}
+	glUseProgram(program.program);
+	currentProgram = &program;
+
+	// the rest of the code works through these
+	shaderProgram = program.program;
+	modelMatrixLocation = program.M;
+	viewMatrixLocation = program.V;
+	projectionMatrixLocation = program.P;
+	KaLocation = program.Ka;
+	KdLocation = program.Kd;
+	KsLocation = program.Ks;
+	NsLocation = program.Ns;
+	LaLocation = program.La;
+	LdLocation = program.Ld;
+	LsLocation = program.Ls;
+	lightPositionLocation = program.lightPosition;
+	lightPowerLocation = program.lightPower;
+	diffuceColorSampler = program.diffuseSampler;
+	specularColorSampler = program.specularSampler;
+	planeLocation = program.planeCoeffs;
+	for (int i = 0; i < JointName::JOINTS; i++) {
+		boneTransformationLocations[i] = program.boneTransformations[i];
+	}
 }
 
 void free()
@@ -685,6 +6087,35 @@ void free()
 	delete segment;
 	delete skeleton;
 	delete skeletonSkin;
+	// writes out the frames still being read back
+	delete frameExporter;
+	frameExporter = NULL;
+	delete trunkSkin;
+	delete leavesSkin;
+	delete forestStreamer;
+	forestStreamer = NULL;
+	for (ResidentTile* tile : residentTiles) delete tile;
+	residentTiles.clear();
+	glDeleteFramebuffers(1, &shadowMapFBO);
+	glDeleteTextures(1, &shadowMapTexture);
+	delete threadPool;
+	threadPool = NULL;
+	// finishes the track
+	delete poseRecorder;
+	poseRecorder = NULL;
+	delete posePlayer;
+	posePlayer = NULL;
+	// writes out the last snapshot
+	delete snapshotWriter;
+	snapshotWriter = NULL;
+	for (auto& lod : lodLevels) {
+		delete lod.trunk;
+		delete lod.leaves;
+	}
+	lodLevels.clear();
+	glDeleteFramebuffers(1, &impostorFBO);
+	glDeleteRenderbuffers(1, &impostorDepthRBO);
+	glDeleteTextures(1, &impostorTexture);
 
 	glDeleteBuffers(1, &surfaceVAO);
 	glDeleteVertexArrays(1, &surfaceVerticesVBO);
@@ -710,163 +6141,152 @@ void free()
 	glDeleteBuffers(1, &leavesVerticiesVBO);
 	glDeleteBuffers(1, &leavesUVVBO);
 	glDeleteBuffers(1, &leavesNormalsVBO);
+	glDeleteBuffers(1, &leavesBoneIndicesVBO);
+	glDeleteBuffers(1, &leavesElementVBO);
 	glDeleteVertexArrays(1, &leavesVAO);
 
 	glDeleteTextures(1, &diffuseTexturetree);
 	glDeleteTextures(1, &diffuseTextureleaves);
-	glDeleteProgram(shaderProgram);
+	for (auto& variant : shaderVariants) {
+		glDeleteProgram(variant.program);
+		variant.program = 0;
+	}
+	glDeleteFramebuffers(1, &frameFBO);
+	glDeleteRenderbuffers(1, &frameColorRBO);
+	glDeleteRenderbuffers(1, &frameDepthRBO);
+	delete offscreenContext;
+	offscreenContext = NULL;
 	glfwTerminate();
 }
 
-void mainLoop()
+void renderFrame(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
-	do
-	{
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		glUseProgram(shaderProgram);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// camera
-		camera->update();
-
-		// first segment
-		//segment->bind();
-
-		mat4 bone1 = mat4(1);
-		glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &bone1[0][0]);
+	useShaderVariant(0);
 
-		// draw segment
-		//segment->draw(GL_LINES);
-		//segment->draw(GL_POINTS);
+	// first segment
+	//segment->bind();
 
+	mat4 bone1 = mat4(1);
+	glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &bone1[0][0]);
 
-		mat4 bone2 = mat4(1)*translate(mat4(), vec3(0, 0.5, 0));
-		glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &bone2[0][0]);
-
-		// draw segment
-		//segment->draw(GL_LINES);
-		//segment->draw(GL_POINTS);
-
-		glBindVertexArray(planeVAO);
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, diffuseTextureleaves);
-		glUniform1i(diffuceColorSampler, 0);
-		//glDrawArrays(GL_TRIANGLES, 0, 6);
-
-		// bind
-		//glBindVertexArray(treeVAO);
-		mat4 projectionMatrix = camera->projectionMatrix;
-		mat4 viewMatrix = camera->viewMatrix;
-		mat4 scale = glm::scale(mat4(), vec3(0.1, 0.1, 0.1));
-		mat4 translation = translate(mat4(), vec3(0, 0, 0));
-
-		glm::mat4 modelMatrix = glm::mat4(1.0) * translation * scale;
-		/////////////////////////////////////////////////////////////////////////////////////////////LAB6
-
-		map<int, float> q;
-		t += 0.4;
-		q[CoordinateName::BONE1_TRA_X] = t;
-		q[CoordinateName::BONE1_TRA_Y] = t;
-		q[CoordinateName::BONE1_TRA_Z] = t;
-		q[CoordinateName::PELVIS_ROT_X] = t;
-		q[CoordinateName::PELVIS_ROT_Y] = t;
-		q[CoordinateName::PELVIS_ROT_Z] = t;
-		q[CoordinateName::HIP_R_FLEX] = t;
-		q[CoordinateName::HIP_R_ADD] = t;
-		q[CoordinateName::HIP_R_ROT] = t;
-		q[CoordinateName::KNEE_R_FLEX] = t;
-		q[CoordinateName::ANKLE_R_FLEX] = t;
-		q[CoordinateName::HIP_L_FLEX] = t;
-		q[CoordinateName::HIP_L_ADD] = t;
-		q[CoordinateName::HIP_L_ROT] = t;
-		q[CoordinateName::KNEE_L_FLEX] = t;
-		q[CoordinateName::ANKLE_L_FLEX] = t;
-		q[CoordinateName::LUMBAR_FLEX] = t;
-		q[CoordinateName::LUMBAR_BEND] = t;
-		q[CoordinateName::LUMBAR_ROT] = t;
-
-		auto jointLocalTransformations = calculateModelPoseFromCoordinates(q);
-		skeleton->setPose(jointLocalTransformations);
-
-
-		glUniform1i(useSkinningLocation, 1);
-		uploadMaterial(boneMaterial);
-		skeleton->draw(viewMatrix, projectionMatrix);
-
-		skeletonSkin->bind();
-
-		glUniform1i(useSkinningLocation, 1);
-
-		mat4 maleModelMatrix = glm::mat4(1.0) * translation * scale;
-		glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &maleModelMatrix[0][0]);
-		glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
-		glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &projectionMatrix[0][0]);
-
-		// Task 4.2: calculate the bone transformations
-		auto T = calculateSkinningTransformations(q);
-		glUniformMatrix4fv(boneTransformationsLocation, T.size(),
-			GL_FALSE, &T[0][0][0]);
-
-		glUniform1i(useSkinningLocation, 1);
+	// draw segment
+	//segment->draw(GL_LINES);
+	//segment->draw(GL_POINTS);
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, diffuseTexturetree);
-		glUniform1i(diffuceColorSampler, 0);
 
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, specularTexturetree);
-		glUniform1i(specularColorSampler, 1);
+	mat4 bone2 = mat4(1)*translate(mat4(), vec3(0, 0.5, 0));
+	glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &bone2[0][0]);
 
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);//for trunk
-		skeletonSkin->draw();
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);//for leaves
-		//*/
+	// draw segment
+	//segment->draw(GL_LINES);
+	//segment->draw(GL_POINTS);
 
-		//	glfwSwapBuffers(window);
-		//	glfwPollEvents();
-		//} while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
-		//			glfwWindowShouldClose(window) == 0);
-		/////////////////////////////////////////////////////////////////////////////////////////////////
+	glBindVertexArray(planeVAO);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, diffuseTextureleaves);
+	glUniform1i(diffuceColorSampler, 0);
+	//glDrawArrays(GL_TRIANGLES, 0, 6);
+
+	// bind
+	//glBindVertexArray(treeVAO);
+	mat4 scale = glm::scale(mat4(), vec3(0.1, 0.1, 0.1));
+	mat4 translation = translate(mat4(), vec3(0, 0, 0));
+
+	glm::mat4 modelMatrix = glm::mat4(1.0) * translation * scale;
+	/////////////////////////////////////////////////////////////////////////////////////////////LAB6
+
+	if (posePlayer != NULL) {
+		// replay a baked track instead of evaluating the coordinates
+		map<int, RigidTransform> pose;
+		posePlayer->seek(playbackFrame);
+		posePlayer->pose(0, pose);
+		playbackFrame = (playbackFrame + 1) % posePlayer->frameCount();
+		skeleton->setPose(pose);
+		updateBonePalette(bonePalette);
+	}
+	else {
+		// fixed steps keep the run reproducible from a snapshot
+		for (int i = 0; i < SIMULATION_STEPS_PER_FRAME; i++) {
+			updateContactForces(simulation);
+			stepSimulation(simulation, dynamicsParameters);
+		}
+		if (snapshotWriter != NULL && simulation.time >= nextSnapshotTime) {
+			snapshotWriter->take(simulation, dynamicsParameters);
+			nextSnapshotTime = simulation.time + SNAPSHOT_INTERVAL;
+		}
+		map<int, float> q = simulationCoordinates(simulation);
 
+		// Task 4.2: calculate the bone transformations, only the joints whose
+		// coordinates changed are evaluated again
+		updateSkinningTransformations(q, bonePalette);
+	}
+	if (poseRecorder != NULL) {
+		poseRecorder->endFrame();
+	}
+	// the forces lasted for the steps of this frame
+	pointForces.clear();
+	pickingBVH.refit(bonePalette.transformations);
+	updateForest(vec3(inverse(viewMatrix)[3]));
+
+	uploadMaterial(boneMaterial);
+	skeleton->draw(viewMatrix, projectionMatrix);
+
+	// draw every tree at the level matching its projected size
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);//for trunk and leaves
+	vector<TreeGroup> groups = treeGroups();
+	mat4 lightViewProjection = calculateLightViewProjection();
+	for (auto& group : groups) {
+		for (auto& tree : *group.trees) {
+			tree.lodLevel = selectLODLevel(tree, lodLevels, viewMatrix, projectionMatrix,
+				LOD_HYSTERESIS);
+		}
+		cullTrees(*group.trees, group.palette->transformations, viewMatrix, projectionMatrix,
+			lightViewProjection);
+		sortLeaves(*group.trees, group.palette->transformations, viewMatrix);
+	}
+	renderTrees(groups, viewMatrix, projectionMatrix, lightViewProjection);
+	//*/
 
-		// Task 1.4c: transfer uniforms to GPU
-		//glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &projectionMatrix[0][0]);
-		//glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
-		//glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &modelMatrix[0][0]);
+	//	glfwSwapBuffers(window);
+	//	glfwPollEvents();
+	//} while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
+	//			glfwWindowShouldClose(window) == 0);
+	/////////////////////////////////////////////////////////////////////////////////////////////////
 
-		//// Task 6.4: bind textures and transmit diffuse and specular maps to the GPU
-		////*/
-		//glActiveTexture(GL_TEXTURE0);
-		//glBindTexture(GL_TEXTURE_2D, diffuseTexturetree);
-		//glUniform1i(diffuceColorSampler, 0);
 
-		//glActiveTexture(GL_TEXTURE1);
-		//glBindTexture(GL_TEXTURE_2D, specularTexturetree);
-		//glUniform1i(specularColorSampler, 1);
-		////*/
+	// Task 1.4c: transfer uniforms to GPU
+	//glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, &projectionMatrix[0][0]);
+	//glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, &viewMatrix[0][0]);
+	//glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, &modelMatrix[0][0]);
 
-		//// draw
-		//glDrawArrays(GL_TRIANGLES, 0, objVerticestree.size());
+	//// Task 6.4: bind textures and transmit diffuse and specular maps to the GPU
+	////*/
+	//glActiveTexture(GL_TEXTURE0);
+	//glBindTexture(GL_TEXTURE_2D, diffuseTexturetree);
+	//glUniform1i(diffuceColorSampler, 0);
 
-		///////////////////////////////////////////////////////////////////////
+	//glActiveTexture(GL_TEXTURE1);
+	//glBindTexture(GL_TEXTURE_2D, specularTexturetree);
+	//glUniform1i(specularColorSampler, 1);
+	////*/
 
-		// bind
-		glBindVertexArray(leavesVAO);
+	//// draw
+	//glDrawArrays(GL_TRIANGLES, 0, objVerticestree.size());
+}
 
-		GLuint a;
-		// Task 6.4: bind textures and transmit diffuse and specular maps to the GPU
-		//*/
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, a = (glfwGetKey(window, GLFW_KEY_SPACE) != GLFW_PRESS) ? diffuseTextureleaves : diffuseTexturetree); //dokimh ths glfwGetKey
-		glUniform1i(diffuceColorSampler, 0);
+void mainLoop()
+{
+	do
+	{
+		// camera
+		camera->update();
+		renderFrame(camera->viewMatrix, camera->projectionMatrix);
 
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, specularTextureleaves);
-		glUniform1i(specularColorSampler, 1);
-		//*/
+		// drag branches with the left button
+		updateDrag(camera->viewMatrix);
 
-		// draw
-		glDrawArrays(GL_TRIANGLES, 0, objVerticesleaves.size());
 		glfwSwapBuffers(window);
 
 		glfwPollEvents();
@@ -874,7 +6294,95 @@ void mainLoop()
 		glfwWindowShouldClose(window) == 0);
 }
 
+void renderOffscreen()
+{
+	// a fixed camera framing the hero tree, it sways inside the view
+	const TreeInstance& hero = trees[0];
+	vec3 center = vec3(hero.modelMatrix * vec4(hero.boundsCenter, 1.0f));
+	float radius = hero.boundsRadius * length(vec3(hero.modelMatrix[0]));
+	mat4 viewMatrix = lookAt(center + vec3(0, 0, 3.0f * radius), center, vec3(0, 1, 0));
+	mat4 projectionMatrix = perspective(radians(45.0f),
+		(float)viewportWidth / viewportHeight, 0.1f, 6.0f * radius);
+
+	frameExporter = new FrameExporter(viewportWidth, viewportHeight, framePrefix);
+	auto start = std::chrono::steady_clock::now();
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, frameFBO);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	for (unsigned int frame = 0; frame < offscreenFrames; frame++) {
+		renderFrame(viewMatrix, projectionMatrix);
+		frameExporter->capture();
+	}
+	frameExporter->finish();
+	double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	cout << frameExporter->capturedFrames() << " frames of " << viewportWidth << "x"
+		<< viewportHeight << " in " << seconds << " s, written to " << framePrefix
+		<< "*.tga" << endl;
+}
+
+void initializeOffscreen()
+{
+	offscreenContext = new OffscreenContext();
+	window = offscreenContext->window();
+
+	// Initialize GLEW, without a window there is no GLX display to look for
+	glewExperimental = GL_TRUE;
+	GLenum status = window == NULL ? glewContextInit() : glewInit();
+	if (status != GLEW_OK)
+	{
+		throw runtime_error("Failed to initialize GLEW\n");
+	}
+
+	// the frame buffer everything is drawn to
+	glGenRenderbuffers(1, &frameColorRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, frameColorRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, viewportWidth, viewportHeight);
+	glGenRenderbuffers(1, &frameDepthRBO);
+	glBindRenderbuffer(GL_RENDERBUFFER, frameDepthRBO);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, viewportWidth, viewportHeight);
+	glGenFramebuffers(1, &frameFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, frameFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, frameColorRBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, frameDepthRBO);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		throw runtime_error("Offscreen framebuffer not complete.\n");
+	}
+	glViewport(0, 0, viewportWidth, viewportHeight);
+}
+
 void initialize()
+{
+	if (offscreen)
+	{
+		initializeOffscreen();
+	}
+	else
+	{
+		initializeWindow();
+	}
+
+	// Gray background color
+	glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
+
+	// Enable depth test
+	glEnable(GL_DEPTH_TEST);
+	// Accept fragment if it closer to the camera than the former one
+	glDepthFunc(GL_LESS);
+
+	glEnable(GL_PROGRAM_POINT_SIZE);
+
+	// enable blending
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// enable textures
+	glEnable(GL_TEXTURE_2D);
+
+	// Log
+	logGLParameters();
+}
+
+void initializeWindow()
 {
 	// Initialize GLFW
 	if (!glfwInit())
@@ -919,43 +6427,120 @@ void initialize()
 	glfwPollEvents();
 	glfwSetCursorPos(window, W_WIDTH / 2, W_HEIGHT / 2);
 
-	// Gray background color
-	glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
-
-	// Enable depth test
-	glEnable(GL_DEPTH_TEST);
-	// Accept fragment if it closer to the camera than the former one
-	glDepthFunc(GL_LESS);
-
-	glEnable(GL_PROGRAM_POINT_SIZE);
-
-	// enable blending
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-	// enable textures
-	glEnable(GL_TEXTURE_2D);
-
-	// Log
-	logGLParameters();
-
 	// Create camera
 	camera = new Camera(window);
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
+	// parameter sweeps run headless, without a window or a GL context
+	for (int i = 1; i < argc; i++) {
+		if (string(argv[i]) == "--sweep") {
+			try
+			{
+				return runBatch(argc, argv);
+			}
+			catch (exception& ex)
+			{
+				cout << ex.what() << endl;
+				return -1;
+			}
+		}
+		if (string(argv[i]) == "--cook-textures") {
+			try
+			{
+				return cookTextures(argc, argv);
+			}
+			catch (exception& ex)
+			{
+				cout << ex.what() << endl;
+				return -1;
+			}
+		}
+		if (string(argv[i]) == "--make-forest") {
+			try
+			{
+				return makeForest(argc, argv);
+			}
+			catch (exception& ex)
+			{
+				cout << ex.what() << endl;
+				return -1;
+			}
+		}
+	}
+
+	// --offscreen WIDTHxHEIGHT: render --frames N (250) without a window and
+	// write them as --output prefix (frame) 00000.tga, ...
+	for (int i = 1; i + 1 < argc; i++) {
+		string option = argv[i];
+		if (option == "--offscreen") {
+			offscreen = true;
+			if (sscanf(argv[++i], "%dx%d", &viewportWidth, &viewportHeight) != 2 ||
+				viewportWidth <= 0 || viewportHeight <= 0) {
+				cout << "Expected --offscreen WIDTHxHEIGHT" << endl;
+				return -1;
+			}
+		}
+		else if (option == "--frames") offscreenFrames = (unsigned int)atoi(argv[++i]);
+		else if (option == "--output") framePrefix = argv[++i];
+	}
+
 	try
 	{
 		initialize();
 		createContext();
-		mainLoop();
+		// --record-poses file: bake the simulated poses to a track
+		// --play-poses file: replay a track without running the simulation
+		// --snapshot file: save the simulation every SNAPSHOT_INTERVAL seconds
+		// --restore file: continue the run saved in a snapshot
+		// --forest file: stream the tiles of a forest within --forest-radius
+		// tiles (2) of the camera
+		for (int i = 1; i + 1 < argc; i++) {
+			if (string(argv[i]) == "--forest-radius") forestRadius = atoi(argv[i + 1]);
+		}
+		for (int i = 1; i + 1 < argc; i++) {
+			string option = argv[i];
+			if (option == "--record-poses") {
+				poseRecorder = new PoseTrackWriter(argv[++i], 1, JointName::JOINTS);
+				skeleton->recorder = poseRecorder;
+			}
+			else if (option == "--play-poses") {
+				posePlayer = new PoseTrackReader();
+				posePlayer->open(argv[++i]);
+				if (posePlayer->frameCount() == 0 ||
+					posePlayer->jointCount() != JointName::JOINTS) {
+					throw runtime_error("Pose track does not match the skeleton\n");
+				}
+			}
+			else if (option == "--snapshot") {
+				snapshotWriter = new SnapshotWriter(argv[++i]);
+			}
+			else if (option == "--restore") {
+				MappedFile file;
+				file.open(argv[++i]);
+				vector<unsigned char> blob(file.data(), file.data() + file.size());
+				loadSnapshot(blob, simulation, dynamicsParameters);
+				if (simulation.q.size() != CoordinateName::DOFS) {
+					throw runtime_error("Snapshot does not match the skeleton\n");
+				}
+				nextSnapshotTime = simulation.time + SNAPSHOT_INTERVAL;
+			}
+			else if (option == "--forest") {
+				forestStreamer = new ForestStreamer(argv[++i], forestRadius);
+				if (forestStreamer->header().speciesCount > TREE_SPECIES) {
+					throw runtime_error("The forest uses species without meshes\n");
+				}
+			}
+		}
+		if (offscreen) renderOffscreen();
+		else mainLoop();
 		free();
 	}
 	catch (exception& ex)
 	{
 		cout << ex.what() << endl;
-		getchar();
+		if (!offscreen) getchar();
 		free();
 		return -1;
 	}
@@ -963,6 +6548,146 @@ int main(void)
 	return 0;
 }
 
+int runBatch(int argc, char** argv)
+{
+	// --sweep name=values (repeatable), --output file, --load seconds,
+	// --release seconds
+	vector<SweepAxis> axes;
+	SweepSettings settings;
+	string output = "sweep.tsw";
+	for (int i = 1; i + 1 < argc; i++) {
+		string option = argv[i];
+		if (option == "--sweep") axes.push_back(parseSweepAxis(argv[++i]));
+		else if (option == "--output") output = argv[++i];
+		else if (option == "--load") settings.loadDuration = (float)atof(argv[++i]);
+		else if (option == "--release") settings.releaseDuration = (float)atof(argv[++i]);
+	}
+	// the hip is the first joint above the root that bends
+	settings.rootCoordinates = { CoordinateName::HIP_R_FLEX, CoordinateName::HIP_R_ADD,
+		CoordinateName::HIP_R_ROT };
+
+	ThreadPool pool;
+	auto start = std::chrono::steady_clock::now();
+	size_t runs = runParameterSweep(pool, createSimulation(SIMULATION_SEED),
+		dynamicsParameters, axes, settings, output);
+	double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	cout << runs << " runs on " << pool.size() << " threads in " << seconds
+		<< " s, results in " << output << endl;
+	return 0;
+}
+
+int cookTextures(int argc, char** argv)
+{
+	// --cook-textures [image...] [--data-textures image...], the textures of
+	// the scene by default; each image is written next to it as image.ctex.
+	// data textures hold values rather than colors and are filtered linearly
+	vector<string> paths;
+	set<string> data;
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		if (option != "--cook-textures" && option != "--data-textures") continue;
+		while (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0) {
+			paths.push_back(argv[++i]);
+			if (option == "--data-textures") data.insert(paths.back());
+		}
+	}
+	if (paths.empty()) {
+		paths = { "maple_bark.png", "MapleTree_specular.bmp", "leaf.png" };
+		data = { "MapleTree_specular.bmp" };
+	}
+
+	// images are decoded the way the runtime always did, through SOIL into
+	// a texture, and read back
+	offscreenContext = new OffscreenContext();
+	glewExperimental = GL_TRUE;
+	GLenum status = offscreenContext->window() == NULL ? glewContextInit() : glewInit();
+	if (status != GLEW_OK)
+	{
+		throw runtime_error("Failed to initialize GLEW\n");
+	}
+
+	ThreadPool pool;
+	for (auto& path : paths) {
+		auto start = std::chrono::steady_clock::now();
+		GLuint texture = loadSOIL(path.c_str());
+		TextureImage image;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &image.width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &image.height);
+		image.rgba.resize((size_t)image.width * image.height * 4);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.rgba.data());
+		glDeleteTextures(1, &texture);
+
+		size_t size = cookTexture(pool, image, path + ".ctex", path, data.count(path) == 0);
+		double seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		cout << path << ": " << image.width << "x" << image.height << ", "
+			<< image.rgba.size() / 1024 << " KB as RGBA, " << size / 1024
+			<< " KB cooked with mipmaps, " << seconds << " s" << endl;
+	}
+	delete offscreenContext;
+	offscreenContext = NULL;
+	glfwTerminate();
+	return 0;
+}
+
+GLuint loadTexture(const char* path)
+{
+	// the cooked texture if it is up to date with the image, decoding the
+	// image otherwise
+	string cooked = string(path) + ".ctex";
+	if (!isCookedTextureCurrent(cooked, path)) return loadSOIL(path);
+	return loadCookedTexture(cooked);
+}
+
+int makeForest(int argc, char** argv)
+{
+	// --make-forest file: maples on a jittered grid --forest-spacing (2) apart,
+	// filling a square --forest-extent (200) wide around a clearing for the
+	// hero tree
+	string path;
+	float extent = 200.0f, spacing = 2.0f;
+	for (int i = 1; i + 1 < argc; i++) {
+		string option = argv[i];
+		if (option == "--make-forest") path = argv[++i];
+		else if (option == "--forest-extent") extent = (float)atof(argv[++i]);
+		else if (option == "--forest-spacing") spacing = (float)atof(argv[++i]);
+	}
+	if (path.empty() || !(extent > 0.0f) || !(spacing > 0.0f)) {
+		throw runtime_error("Expected --make-forest file\n");
+	}
+
+	uint64_t rng = 0x9E3779B97F4A7C15ull;
+	auto random = [&rng]() {
+		// xorshift, uniform in [0, 1)
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		return (float)(rng >> 40) / 16777216.0f;
+	};
+	vector<ForestInstance> instances;
+	for (float z = -0.5f * extent; z < 0.5f * extent; z += spacing) {
+		for (float x = -0.5f * extent; x < 0.5f * extent; x += spacing) {
+			vec3 position(x + spacing * 0.8f * (random() - 0.5f), 0.0f,
+				z + spacing * 0.8f * (random() - 0.5f));
+			if (length(position) < 3.0f * spacing) continue;
+			ForestInstance instance;
+			memset(&instance, 0, sizeof(instance));
+			instance.species = 0;
+			instance.setModelMatrix(translate(mat4(), position) *
+				rotate(mat4(), 6.2831853f * random(), vec3(0, 1, 0)) *
+				glm::scale(mat4(), vec3(0.1f * (0.8f + 0.4f * random()))));
+			instance.seed = rng;
+			instances.push_back(instance);
+		}
+	}
+	// tiles of about a hundred trees
+	writeForest(path, 10.0f * spacing, TREE_SPECIES, instances);
+	cout << instances.size() << " trees written to " << path << endl;
+	return 0;
+}
 
 void defineJointPoints()
 {
@@ -990,50 +6715,3 @@ void defineJointPoints()
 	treeJoints.push_back(vec3((4, 42, 0)*0.1));
 	treeJoints.push_back(vec3((-3, 43, -3)*0.1));
 }
-
-//Quicksort algorithm from low to high
-void quickSort(std::vector<float> &arr, std::vector<int> &indices, int left, int right)
-{
-	int i = left, j = right;
-	float tmp1;
-	int tmp2;
-	float pivot = arr[(left + right) / 2];
-
-
-
-	/* partition */
-
-	while (i <= j)
-	{
-		while (arr[i] < pivot)	i++;
-
-		while (arr[j] > pivot)	j--;
-
-
-		if (i <= j)
-		{
-			tmp1 = arr[i];
-			arr[i] = arr[j];
-			arr[j] = tmp1;
-
-
-			tmp2 = indices[i];
-			indices[i] = indices[j];
-			indices[j] = tmp2;
-
-			i++;
-			j--;
-		}
-	};
-
-
-
-	/* recursion */
-
-	if (left < j)
-		quickSort(arr, indices, left, j);
-
-	if (i < right)
-		quickSort(arr, indices, i, right);
-
-}